@@ -0,0 +1,262 @@
+// Allocation latency of the data block bitmap on a 90%-full image.
+//
+// Usage: alloc_bench [image_gib]
+//
+// Builds the data bitmap of an image of the given size (default 4 GiB of
+// BLOCK_SIZE blocks), fills 90% of it, then times steady-state allocations:
+// each allocation is paired with freeing a random allocated block so the
+// image stays 90% full. The old bit-at-a-time first-fit loop is timed next
+// to bitmap_alloc for comparison. Then it times the search for a run of
+// contiguous free blocks when the only long enough run is near the end.
+// Finally 1, 2, 4, ... threads allocate and free blocks at once, each with
+// a cursor of its own, next to the same calls made under one mutex as wfs
+// used to.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "wfs.h"
+#include "bitmap.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The allocator wfs used before: test one bit per iteration from bit 0
+static long linear_alloc(unsigned char *bitmap, size_t nbits)
+{
+    for (size_t i = 0; i < nbits; i++)
+    {
+        if (!(bitmap[i / 8] & (1 << (i % 8))))
+        {
+            bitmap[i / 8] |= 1 << (i % 8);
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Marks 90% of the bitmap used, either as one prefix or scattered at random
+static void fill(unsigned char *bitmap, size_t nbits, bool fragmented)
+{
+    memset(bitmap, 0, (nbits + 7) / 8 + 8);
+    srand(537);
+    for (size_t i = 0; i < nbits; i++)
+    {
+        bool used = fragmented ? rand() % 10 != 0 : i < nbits / 10 * 9;
+        if (used)
+        {
+            bitmap[i / 8] |= 1 << (i % 8);
+        }
+    }
+}
+
+// Frees a random allocated bit so the next allocation has somewhere to go
+static void free_random(unsigned char *bitmap, size_t nbits, struct wfs_bitmap *bm)
+{
+    for (;;)
+    {
+        size_t bit = ((size_t)rand() * RAND_MAX + rand()) % nbits;
+        if (bitmap[bit / 8] & (1 << (bit % 8)))
+        {
+            if (bm)
+                bitmap_clear(bm, bit);
+            else
+                bitmap[bit / 8] &= ~(1 << (bit % 8));
+            return;
+        }
+    }
+}
+
+// Returns the first run of n clear bits by checking every bit
+static long linear_find_run(const unsigned char *bitmap, size_t nbits, size_t n)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < nbits; i++)
+    {
+        len = bitmap[i / 8] & (1 << (i % 8)) ? 0 : len + 1;
+        if (len == n)
+            return i + 1 - n;
+    }
+    return -1;
+}
+
+static void run_search(unsigned char *bitmap, size_t nbits, size_t n)
+{
+    // Fragmented 90%-full space whose free stretches are all shorter than n, plus one run of n near the end
+    fill(bitmap, nbits, true);
+    for (size_t i = 0; i < nbits; i += n / 2)
+    {
+        bitmap[i / 8] |= 1 << (i % 8);
+    }
+    size_t target = nbits - nbits / 100;
+    for (size_t i = target; i < target + n; i++)
+    {
+        bitmap[i / 8] &= ~(1 << (i % 8));
+    }
+
+    int linear_ops = 20;
+    double start = now();
+    for (int i = 0; i < linear_ops; i++)
+    {
+        if (linear_find_run(bitmap, nbits, n) == -1)
+            abort();
+    }
+    double linear_ns = (now() - start) / linear_ops * 1e9;
+
+    struct wfs_bitmap bm;
+    bitmap_init(&bm, bitmap, nbits);
+    int word_ops = 20000;
+    start = now();
+    for (int i = 0; i < word_ops; i++)
+    {
+        if (bitmap_find_run(&bm, 0, n) == -1)
+            abort();
+    }
+    double word_ns = (now() - start) / word_ops * 1e9;
+    bitmap_destroy(&bm);
+
+    printf("run of %-4zu linear %12.0f ns/op   bitmap_find_run %5.0f ns/op   (%.0fx)\n",
+           n, linear_ns, word_ns, linear_ns / word_ns);
+}
+
+static void run(unsigned char *bitmap, size_t nbits, bool fragmented)
+{
+    const char *layout = fragmented ? "fragmented" : "sequential";
+
+    // The linear scan is slow enough on a full prefix that a few hundred operations suffice
+    int linear_ops = fragmented ? 100000 : 200;
+    fill(bitmap, nbits, fragmented);
+    double start = now();
+    for (int i = 0; i < linear_ops; i++)
+    {
+        free_random(bitmap, nbits, NULL);
+        linear_alloc(bitmap, nbits);
+    }
+    double linear_ns = (now() - start) / linear_ops * 1e9;
+
+    int word_ops = 1000000;
+    fill(bitmap, nbits, fragmented);
+    struct wfs_bitmap bm;
+    bitmap_init(&bm, bitmap, nbits);
+    start = now();
+    for (int i = 0; i < word_ops; i++)
+    {
+        free_random(bitmap, nbits, &bm);
+        bitmap_alloc(&bm, NULL);
+    }
+    double word_ns = (now() - start) / word_ops * 1e9;
+    bitmap_destroy(&bm);
+
+    printf("%-10s  linear %12.0f ns/op   bitmap_alloc %8.0f ns/op   (%.0fx)\n",
+           layout, linear_ns, word_ns, linear_ns / word_ns);
+}
+
+#define BATCH (64)
+#define THREAD_OPS (200000)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct worker
+{
+    pthread_t thread;
+    struct wfs_bitmap *bm;
+    size_t cursor;
+    bool locked;
+};
+
+// Allocates BATCH blocks and frees them again, over and over
+static void *alloc_worker(void *arg)
+{
+    struct worker *w = arg;
+    long bits[BATCH];
+    for (int op = 0; op < THREAD_OPS; op += BATCH)
+    {
+        for (int i = 0; i < BATCH; i++)
+        {
+            if (w->locked)
+                pthread_mutex_lock(&lock);
+            bits[i] = bitmap_alloc(w->bm, w->locked ? NULL : &w->cursor);
+            if (w->locked)
+                pthread_mutex_unlock(&lock);
+            if (bits[i] == -1)
+                abort();
+        }
+        for (int i = 0; i < BATCH; i++)
+        {
+            if (w->locked)
+                pthread_mutex_lock(&lock);
+            bitmap_clear(w->bm, bits[i]);
+            if (w->locked)
+                pthread_mutex_unlock(&lock);
+        }
+    }
+    return NULL;
+}
+
+// Returns the allocations and frees per second of n threads on a half-full bitmap
+static double run_threads(unsigned char *bitmap, size_t nbits, int n, bool locked)
+{
+    memset(bitmap, 0, (nbits + 7) / 8 + 8);
+    for (size_t i = 0; i < nbits; i += 2)
+    {
+        bitmap[i / 8] |= 1 << (i % 8);
+    }
+    struct wfs_bitmap bm;
+    bitmap_init(&bm, bitmap, nbits);
+    struct worker workers[n];
+    double start = now();
+    for (int i = 0; i < n; i++)
+    {
+        workers[i] = (struct worker){.bm = &bm, .cursor = nbits / n * i, .locked = locked};
+        pthread_create(&workers[i].thread, NULL, alloc_worker, &workers[i]);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = now() - start;
+    bitmap_destroy(&bm);
+    return 2.0 * THREAD_OPS * n / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    double gib = argc > 1 ? atof(argv[1]) : 4;
+    size_t nbits = (size_t)(gib * (1UL << 30)) / BLOCK_SIZE;
+    if (nbits == 0)
+    {
+        fprintf(stderr, "Usage: %s [image_gib]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Offset the bitmap by a few bytes, as it is in a real image
+    unsigned char *mem = malloc((nbits + 7) / 8 + 16);
+    if (!mem)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    unsigned char *bitmap = mem + 4;
+
+    printf("%.1f GiB image, %zu blocks of %d bytes, 90%% full\n", gib, nbits, BLOCK_SIZE);
+    printf("(each operation frees one random block and allocates one; times include both)\n");
+    run(bitmap, nbits, false);
+    run(bitmap, nbits, true);
+    run_search(bitmap, nbits, 256);
+
+    printf("threads   one mutex Mops/s   lock-free Mops/s   (each allocating and freeing, half full)\n");
+    for (int n = 1; n <= 8; n *= 2)
+    {
+        double locked = run_threads(bitmap, nbits, n, true);
+        double lock_free = run_threads(bitmap, nbits, n, false);
+        printf("%7d %18.2f %18.2f\n", n, locked / 1e6, lock_free / 1e6);
+    }
+
+    free(mem);
+    return 0;
+}
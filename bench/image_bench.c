@@ -0,0 +1,153 @@
+// Block access throughput of the two image backends: mmap and pread/pwrite with a block cache.
+//
+// Usage: image_bench <scratch file> [image_mib] [cache_mib]
+//
+// Fills a scratch image of image_mib MiB (default 256) and opens it with each
+// backend in turn, the cache holding cache_mib MiB (default 16) of BLOCK_SIZE
+// blocks. Each backend then reads every block in order, reads random blocks
+// from a set that fits in the cache, reads random blocks from the whole image,
+// and overwrites random blocks, the last figure including an image_sync that
+// writes them through to the disk, msync for the mapping, before the image is
+// closed. Blocks are taken BATCH at a time and released together,
+// as a request in wfs would. The image's pages are dropped from the page cache
+// before each backend starts.
+#define _GNU_SOURCE // For posix_fadvise
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "wfs.h"
+#include "image.h"
+
+#define BATCH (32)
+#define RANDOM_OPS (1 << 20)
+
+static const char *path;
+static off_t image_size;
+static size_t nblocks;
+static size_t hot_blocks; // Half the cache
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void open_image(size_t cache_blocks)
+{
+    int fd = open(path, O_RDWR);
+    if (fd == -1)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    posix_fadvise(fd, 0, image_size, POSIX_FADV_DONTNEED);
+    if (image_open(fd, image_size, BLOCK_SIZE, cache_blocks) == -1)
+    {
+        perror("image_open");
+        exit(EXIT_FAILURE);
+    }
+    image_start();
+}
+
+static void fill_image(void)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char *buf = malloc(1 << 20);
+    if (fd == -1 || !buf)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 'i', 1 << 20);
+    for (off_t pos = 0; pos < image_size; pos += 1 << 20)
+    {
+        if (pwrite(fd, buf, 1 << 20, pos) != 1 << 20)
+        {
+            perror("pwrite");
+            exit(EXIT_FAILURE);
+        }
+    }
+    fsync(fd);
+    close(fd);
+    free(buf);
+}
+
+// Reads or overwrites ops blocks picked from the first span blocks, or all in order if span is 0;
+// returns blocks per second
+static double run(size_t ops, size_t span, enum image_access access)
+{
+    unsigned long sum = 0;
+    unsigned int seed = 537;
+    double start = now();
+    for (size_t i = 0; i < ops; i++)
+    {
+        size_t b = span ? ((size_t)rand_r(&seed) * RAND_MAX + rand_r(&seed)) % span : i;
+        char *block = image_block((off_t)b * BLOCK_SIZE, access);
+        if (access == IMAGE_READ)
+            sum += block[i % BLOCK_SIZE];
+        else
+            memset(block, (int)i, BLOCK_SIZE);
+        if ((i + 1) % BATCH == 0)
+            image_release();
+    }
+    image_release();
+    double elapsed = now() - start;
+    if (sum == 1)
+        printf(" "); // Keeps the reads from being optimized out
+    return ops / elapsed;
+}
+
+static void bench(const char *name, size_t cache_blocks)
+{
+    open_image(cache_blocks);
+    double seq = run(nblocks, 0, IMAGE_READ) * BLOCK_SIZE / (1 << 20);
+    double hot_reads = run(RANDOM_OPS, hot_blocks, IMAGE_READ);
+    double cold_reads = run(RANDOM_OPS, nblocks, IMAGE_READ);
+
+    double start = now();
+    size_t writes = RANDOM_OPS / 4;
+    run(writes, nblocks, IMAGE_OVERWRITE);
+    if (image_sync() == -1)
+    {
+        perror("image_sync");
+        exit(EXIT_FAILURE);
+    }
+    double write_mib = writes * BLOCK_SIZE / (now() - start) / (1 << 20);
+    if (image_close() == -1)
+    {
+        perror("image_close");
+        exit(EXIT_FAILURE);
+    }
+    printf("%-7s %15.1f %16.2f %17.2f %12.1f\n", name, seq, hot_reads / 1e6, cold_reads / 1e6, write_mib);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <scratch file> [image_mib] [cache_mib]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    path = argv[1];
+    image_size = (off_t)((argc > 2 ? atof(argv[2]) : 256) * (1 << 20)) / BLOCK_SIZE * BLOCK_SIZE;
+    size_t cache_blocks = (size_t)((argc > 3 ? atof(argv[3]) : 16) * (1 << 20)) / BLOCK_SIZE;
+    nblocks = image_size / BLOCK_SIZE;
+    hot_blocks = cache_blocks / 2;
+    if (hot_blocks == 0 || hot_blocks > nblocks)
+    {
+        fprintf(stderr, "The cache must hold some blocks and be at most twice the image\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fill_image();
+    printf("%.0f MiB image, %zu-block cache, blocks of %d bytes\n", (double)image_size / (1 << 20), cache_blocks, BLOCK_SIZE);
+    printf("backend  seq read MiB/s  hot read Mops/s  cold read Mops/s  write MiB/s\n");
+    bench("mmap", 0);
+    bench("cache", cache_blocks);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,222 @@
+// Read and stat throughput of a mounted wfs as the number of client threads grows.
+//
+// Usage: mt_bench <directory in a wfs mount> [file_mib] [max_threads]
+//
+// Writes one file of file_mib MiB (default 16) into the directory, then for
+// 1, 2, 4, ... max_threads threads (default 8) has every thread read its own
+// slice of the file over and over for a fixed time. Each pass first drops the
+// slice from the page cache so that the reads reach wfs rather than the kernel.
+// The same thread counts then stat a set of small files in a loop, which goes
+// through getattr and lookup. Last, every thread creates, writes and
+// removes files of its own, which goes through inode and block allocation.
+// With wfs mounted without -s, throughput should grow with the thread count
+// until the disk image or the CPUs run out; with -s it stays flat.
+#define _GNU_SOURCE // For posix_fadvise
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK (128 * 1024)
+#define RUN_SECONDS (2.0)
+#define STAT_FILES (64)
+#define CREATE_SIZE (64 * 1024)
+
+static const char *dir;
+static char path[4096];
+static off_t file_size;
+static int nthreads;
+static volatile int stop;
+
+struct worker
+{
+    pthread_t thread;
+    int id;
+    double ops; // Bytes read or files stat'ed
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *read_worker(void *arg)
+{
+    struct worker *w = arg;
+    char *buf = malloc(CHUNK);
+    int fd = open(path, O_RDONLY);
+    if (!buf || fd == -1)
+    {
+        perror("read_worker");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t slice = file_size / nthreads / CHUNK * CHUNK;
+    off_t first = slice * w->id;
+    while (!stop)
+    {
+        posix_fadvise(fd, first, slice, POSIX_FADV_DONTNEED);
+        for (off_t pos = first; pos < first + slice && !stop; pos += CHUNK)
+        {
+            ssize_t n = pread(fd, buf, CHUNK, pos);
+            if (n <= 0)
+            {
+                perror("pread");
+                exit(EXIT_FAILURE);
+            }
+            w->ops += n;
+        }
+    }
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static void *stat_worker(void *arg)
+{
+    struct worker *w = arg;
+    char name[4096];
+    struct stat st;
+    for (int i = w->id; !stop; i++)
+    {
+        snprintf(name, sizeof(name), "%s/mt_bench.%d", dir, i % STAT_FILES);
+        if (stat(name, &st) != 0)
+        {
+            perror("stat");
+            exit(EXIT_FAILURE);
+        }
+        w->ops++;
+    }
+    return NULL;
+}
+
+static void *create_worker(void *arg)
+{
+    struct worker *w = arg;
+    char name[4096];
+    char *buf = malloc(CREATE_SIZE);
+    if (!buf)
+    {
+        perror("create_worker");
+        exit(EXIT_FAILURE);
+    }
+    memset(buf, 'c', CREATE_SIZE);
+    for (int i = 0; !stop; i++)
+    {
+        snprintf(name, sizeof(name), "%s/mt_bench.t%d.%d", dir, w->id, i % 16);
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || write(fd, buf, CREATE_SIZE) != CREATE_SIZE)
+        {
+            perror(name);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        unlink(name);
+        w->ops += CREATE_SIZE;
+    }
+    free(buf);
+    return NULL;
+}
+
+// Runs fn on n threads for RUN_SECONDS and returns the total operations per second
+static double run(void *(*fn)(void *), int n)
+{
+    struct worker *workers = calloc(n, sizeof(struct worker));
+    if (!workers)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    nthreads = n;
+    stop = 0;
+    double start = now();
+    for (int i = 0; i < n; i++)
+    {
+        workers[i].id = i;
+        pthread_create(&workers[i].thread, NULL, fn, &workers[i]);
+    }
+    usleep(RUN_SECONDS * 1e6);
+    stop = 1;
+    double ops = 0;
+    for (int i = 0; i < n; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+    }
+    double elapsed = now() - start;
+    free(workers);
+    return ops / elapsed;
+}
+
+static void create_file(const char *name, off_t size)
+{
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    char *buf = malloc(CHUNK);
+    memset(buf, 'w', CHUNK);
+    for (off_t pos = 0; pos < size; pos += CHUNK)
+    {
+        size_t n = size - pos < CHUNK ? size - pos : CHUNK;
+        if (write(fd, buf, n) != (ssize_t)n)
+        {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(buf);
+    close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <directory in a wfs mount> [file_mib] [max_threads]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    dir = argv[1];
+    file_size = (off_t)(argc > 2 ? atof(argv[2]) : 16) * (1 << 20);
+    int max_threads = argc > 3 ? atoi(argv[3]) : 8;
+    if (file_size < CHUNK || max_threads < 1)
+    {
+        fprintf(stderr, "The file must be at least %d KiB and there must be a thread\n", CHUNK / 1024);
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(path, sizeof(path), "%s/mt_bench.dat", dir);
+    create_file(path, file_size);
+    for (int i = 0; i < STAT_FILES; i++)
+    {
+        char name[4096];
+        snprintf(name, sizeof(name), "%s/mt_bench.%d", dir, i);
+        create_file(name, 100);
+    }
+
+    printf("threads   read MiB/s   stat ops/s   create+write MiB/s\n");
+    for (int n = 1; n <= max_threads; n *= 2)
+    {
+        double bytes = run(read_worker, n);
+        double stats = run(stat_worker, n);
+        double created = run(create_worker, n);
+        printf("%7d %12.1f %12.0f %20.1f\n", n, bytes / (1 << 20), stats, created / (1 << 20));
+    }
+
+    unlink(path);
+    for (int i = 0; i < STAT_FILES; i++)
+    {
+        char name[4096];
+        snprintf(name, sizeof(name), "%s/mt_bench.%d", dir, i);
+        unlink(name);
+    }
+    return 0;
+}
@@ -0,0 +1,456 @@
+#include <endian.h>
+#include <stdlib.h>
+#include "bitmap.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+static int summary_init(struct bitmap_summary *s, size_t n)
+{
+    // One level per 64-way fan-out until a single word covers everything
+    s->levels = 0;
+    do
+    {
+        size_t words = (n + 63) / 64;
+        s->bits[s->levels] = calloc(words, sizeof(uint64_t));
+        if (!s->bits[s->levels])
+            return -1;
+        s->nwords[s->levels++] = words;
+        n = words;
+    } while (n > 1 && s->levels < BITMAP_MAX_LEVELS);
+    return 0;
+}
+
+static void summary_destroy(struct bitmap_summary *s)
+{
+    for (int k = 0; k < s->levels; k++)
+    {
+        free(s->bits[k]);
+    }
+    s->levels = 0;
+}
+
+// Sets bit i of level k and whichever levels above it still read as zero
+static void summary_set(struct bitmap_summary *s, int k, size_t i)
+{
+    for (; k < s->levels; k++)
+    {
+        uint64_t was = __atomic_fetch_or(&s->bits[k][i / 64], 1UL << (i % 64), __ATOMIC_SEQ_CST);
+        if (was)
+            return; // The levels above already know this word is non-zero, or its first bit's setter is telling them
+        i /= 64;
+    }
+}
+
+static void summary_clear(struct bitmap_summary *s, size_t i)
+{
+    for (int k = 0; k < s->levels; k++)
+    {
+        uint64_t left = __atomic_and_fetch(&s->bits[k][i / 64], ~(1UL << (i % 64)), __ATOMIC_SEQ_CST);
+        if (k > 0 && __atomic_load_n(&s->bits[k - 1][i], __ATOMIC_SEQ_CST))
+        {
+            // The word below gained a bit after it emptied, and its setter may have found this
+            // level still set: put the bit back
+            summary_set(s, k, i);
+            return;
+        }
+        if (left)
+            return; // The word still has other bits, so the levels above are unchanged
+        i /= 64;
+    }
+}
+
+// Returns the first set level-0 index at or after i, or -1
+static long summary_find(const struct bitmap_summary *s, size_t i)
+{
+    // Climb until some level has a set bit later in the same word
+    int k = 0;
+    for (;;)
+    {
+        if (k == s->levels || i / 64 >= s->nwords[k])
+            return -1;
+        uint64_t bits = __atomic_load_n(&s->bits[k][i / 64], __ATOMIC_RELAXED) & (~0UL << (i % 64));
+        if (bits)
+        {
+            i = i / 64 * 64 + __builtin_ctzl(bits);
+            break;
+        }
+        i = i / 64 + 1;
+        k++;
+    }
+
+    // Then descend along the first set bit of each level
+    while (k > 0)
+    {
+        k--;
+        uint64_t bits = __atomic_load_n(&s->bits[k][i], __ATOMIC_RELAXED);
+        if (!bits)
+            return summary_find(s, (i + 1) << (6 * (k + 1))); // Emptied meanwhile: search on past it
+        i = i * 64 + __builtin_ctzl(bits);
+    }
+    return i;
+}
+
+// Whether word w holds bytes that are not the bitmap's. Code elsewhere writes those without
+// atomics, so the word is read and updated a byte at a time, keeping to the bitmap's own bytes.
+static bool shared_word(const struct wfs_bitmap *bm, size_t w)
+{
+    size_t end = bm->shift + bm->nbits;
+    return (w == 0 && bm->shift) || (w == (end - 1) / 64 && (end + 7) / 8 % 8);
+}
+
+// Loads word w in host order; bytes that are not the bitmap's read as zero
+static uint64_t load_word(const struct wfs_bitmap *bm, size_t w)
+{
+    // Bit k of a little-endian word is bit k % 8 of byte k / 8, matching the on-disk order
+    if (!shared_word(bm, w))
+        return le64toh(__atomic_load_n(&bm->words[w], __ATOMIC_RELAXED));
+    const unsigned char *bytes = (const unsigned char *)&bm->words[w];
+    size_t lo = w == 0 ? bm->shift / 8 : 0;
+    size_t hi = min(8, (bm->shift + bm->nbits + 7) / 8 - w * 8);
+    uint64_t value = 0;
+    for (size_t b = lo; b < hi; b++)
+    {
+        value |= (uint64_t)__atomic_load_n(&bytes[b], __ATOMIC_RELAXED) << (8 * b);
+    }
+    return value;
+}
+
+// Atomically sets or clears the bits of mask in word w, returning their previous values
+static uint64_t update_bits(struct wfs_bitmap *bm, size_t w, uint64_t mask, bool set)
+{
+    if (!shared_word(bm, w))
+    {
+        uint64_t m = htole64(mask);
+        return le64toh(set ? __atomic_fetch_or(&bm->words[w], m, __ATOMIC_ACQ_REL)
+                           : __atomic_fetch_and(&bm->words[w], ~m, __ATOMIC_ACQ_REL));
+    }
+    unsigned char *bytes = (unsigned char *)&bm->words[w];
+    uint64_t was = 0;
+    for (size_t b = 0; b < 8; b++)
+    {
+        unsigned char m = mask >> (8 * b);
+        if (m)
+        {
+            unsigned char old = set ? __atomic_fetch_or(&bytes[b], m, __ATOMIC_ACQ_REL)
+                                    : __atomic_fetch_and(&bytes[b], (unsigned char)~m, __ATOMIC_ACQ_REL);
+            was |= (uint64_t)old << (8 * b);
+        }
+    }
+    return was;
+}
+
+// Returns word w of the bitmap with the bits outside the tracked range reading as set
+static uint64_t word_value(const struct wfs_bitmap *bm, size_t w)
+{
+    uint64_t value = load_word(bm, w);
+    size_t end = bm->shift + bm->nbits;
+    if (w == 0)
+        value |= (1UL << bm->shift) - 1;
+    if (w == (end - 1) / 64 && end % 64)
+        value |= ~0UL << (end % 64);
+    return value;
+}
+
+// Brings both summaries up to date for word w
+static void update_word(struct wfs_bitmap *bm, size_t w)
+{
+    // Another thread may change the word while this one is at it. The last to change it finds the
+    // value it summarised gone stale and goes round again, so the summaries end up matching.
+    for (;;)
+    {
+        uint64_t value = word_value(bm, w);
+        if (value != ~0UL)
+            summary_set(&bm->has_free, 0, w);
+        else
+            summary_clear(&bm->has_free, w);
+        if (value == 0)
+            summary_set(&bm->all_free, 0, w);
+        else
+            summary_clear(&bm->all_free, w);
+        if (word_value(bm, w) == value)
+            return;
+    }
+}
+
+// Returns the mask of bits [lo, hi) of a word
+static uint64_t bit_range(size_t lo, size_t hi)
+{
+    return (hi == 64 ? ~0UL : (1UL << hi) - 1) & (~0UL << lo);
+}
+
+// Sets the bits of mask in word w, returning those that were clear and so now belong to the caller
+static uint64_t set_bits(struct wfs_bitmap *bm, size_t w, uint64_t mask)
+{
+    uint64_t was = update_bits(bm, w, mask, true);
+    uint64_t taken = mask & ~was;
+    if (taken)
+    {
+        __atomic_sub_fetch(&bm->nfree, __builtin_popcountl(taken), __ATOMIC_RELAXED);
+        update_word(bm, w);
+    }
+    return taken;
+}
+
+// Clears the bits of mask in word w, returning those that were set
+static uint64_t clear_bits(struct wfs_bitmap *bm, size_t w, uint64_t mask)
+{
+    uint64_t was = update_bits(bm, w, mask, false);
+    uint64_t freed = mask & was;
+    if (freed)
+    {
+        __atomic_add_fetch(&bm->nfree, __builtin_popcountl(freed), __ATOMIC_RELAXED);
+        update_word(bm, w);
+    }
+    return freed;
+}
+
+int bitmap_init(struct wfs_bitmap *bm, void *base, size_t nbits)
+{
+    uintptr_t addr = (uintptr_t)base;
+    bm->words = (uint64_t *)(addr & ~(uintptr_t)7);
+    bm->shift = (addr & 7) * 8;
+    bm->nbits = nbits;
+    bm->hint = 0;
+
+    size_t nwords = (bm->shift + nbits + 63) / 64;
+    if (summary_init(&bm->has_free, nwords) != 0 || summary_init(&bm->all_free, nwords) != 0)
+    {
+        bitmap_destroy(bm);
+        return -1;
+    }
+
+    // Count the set bits and build the summaries once; every later change keeps them up to date
+    size_t used = 0;
+    for (size_t w = 0; w < nwords; w++)
+    {
+        used += __builtin_popcountl(word_value(bm, w));
+        update_word(bm, w);
+    }
+    bm->nfree = nwords * 64 - used;
+    return 0;
+}
+
+void bitmap_destroy(struct wfs_bitmap *bm)
+{
+    summary_destroy(&bm->has_free);
+    summary_destroy(&bm->all_free);
+}
+
+size_t bitmap_nfree(const struct wfs_bitmap *bm)
+{
+    return __atomic_load_n(&bm->nfree, __ATOMIC_RELAXED);
+}
+
+bool bitmap_test(const struct wfs_bitmap *bm, size_t bit)
+{
+    size_t pos = bit + bm->shift;
+    return word_value(bm, pos / 64) & (1UL << (pos % 64));
+}
+
+bool bitmap_set(struct wfs_bitmap *bm, size_t bit)
+{
+    size_t pos = bit + bm->shift;
+    return set_bits(bm, pos / 64, 1UL << (pos % 64)) != 0;
+}
+
+bool bitmap_clear(struct wfs_bitmap *bm, size_t bit)
+{
+    size_t pos = bit + bm->shift;
+    return clear_bits(bm, pos / 64, 1UL << (pos % 64)) != 0;
+}
+
+size_t bitmap_clear_run(struct wfs_bitmap *bm, size_t start, size_t n)
+{
+    size_t pos = start + bm->shift;
+    size_t end = pos + n;
+    size_t cleared = 0;
+    while (pos < end)
+    {
+        size_t w = pos / 64;
+        cleared += __builtin_popcountl(clear_bits(bm, w, bit_range(pos % 64, min(end - w * 64, 64))));
+        pos = (w + 1) * 64;
+    }
+    return cleared;
+}
+
+// Returns the first clear bit at or after from, or -1
+static long bitmap_scan(const struct wfs_bitmap *bm, size_t from)
+{
+    while (from < bm->nbits)
+    {
+        size_t pos = from + bm->shift;
+        size_t w = pos / 64;
+        uint64_t clear = ~word_value(bm, w) & (~0UL << (pos % 64));
+        if (clear)
+            return w * 64 + __builtin_ctzl(clear) - bm->shift;
+
+        // The summary may lead to a word that has just filled up; then look on from there
+        long next = summary_find(&bm->has_free, w + 1);
+        if (next == -1)
+            return -1;
+        from = next * 64 - bm->shift;
+    }
+    return -1;
+}
+
+// Returns how many bits from start on are clear, counting no further than n.
+// The caller guarantees start + n <= nbits.
+static size_t clear_run_length(const struct wfs_bitmap *bm, size_t start, size_t n)
+{
+    size_t pos = start + bm->shift;
+    size_t len = 0;
+    while (len < n)
+    {
+        uint64_t used = word_value(bm, pos / 64) >> (pos % 64);
+        if (used)
+            return min(n, len + __builtin_ctzl(used));
+        len += 64 - pos % 64;
+        pos += 64 - pos % 64;
+    }
+    return n;
+}
+
+long bitmap_find_run(const struct wfs_bitmap *bm, size_t from, size_t n)
+{
+    if (n == 0)
+        return -1;
+    size_t start = from;
+    while (start + n <= bm->nbits)
+    {
+        size_t candidate;
+        if (n >= 128)
+        {
+            // A run this long covers a whole clear word, so jump to the next such word and back up
+            // over the clear bits leading into it: that is the only run the word can belong to
+            long w = summary_find(&bm->all_free, (start + bm->shift) / 64);
+            if (w == -1)
+                return -1;
+            size_t lead = 0;
+            if (w > 0)
+            {
+                uint64_t before = word_value(bm, w - 1);
+                lead = before ? __builtin_clzl(before) : 64;
+            }
+            size_t first = w * 64 - lead - bm->shift;
+            candidate = first > start ? first : start;
+        }
+        else
+        {
+            long bit = bitmap_scan(bm, start);
+            if (bit == -1)
+                return -1;
+            candidate = bit;
+        }
+        if (candidate + n > bm->nbits)
+            return -1;
+
+        size_t len = clear_run_length(bm, candidate, n);
+        if (len >= n)
+            return candidate;
+        start = candidate + len + 1; // Bit candidate + len is set
+    }
+    return -1;
+}
+
+// Claims the first clear bit at or after from, wrapping once; returns it or -1
+static long alloc_from(struct wfs_bitmap *bm, size_t from)
+{
+    bool wrapped = false;
+    while (bitmap_nfree(bm) > 0)
+    {
+        long bit = bitmap_scan(bm, from);
+        if (bit == -1)
+        {
+            if (wrapped)
+                return -1;
+            wrapped = true;
+            from = 0;
+            continue;
+        }
+        if (bitmap_set(bm, bit))
+            return bit;
+        from = bit + 1; // Another thread got there first
+    }
+    return -1;
+}
+
+long bitmap_alloc(struct wfs_bitmap *bm, size_t *cursor)
+{
+    // Next fit: resume after the last allocation so a full prefix is crossed once per lap, not once per call
+    cursor = cursor ? cursor : &bm->hint;
+    long bit = alloc_from(bm, __atomic_load_n(cursor, __ATOMIC_RELAXED));
+    if (bit != -1)
+    {
+        __atomic_store_n(cursor, bit + 1 < bm->nbits ? bit + 1 : 0, __ATOMIC_RELAXED);
+    }
+    return bit;
+}
+
+long bitmap_alloc_run(struct wfs_bitmap *bm, size_t n, size_t *cursor)
+{
+    cursor = cursor ? cursor : &bm->hint;
+    size_t from = __atomic_load_n(cursor, __ATOMIC_RELAXED);
+    bool wrapped = false;
+    while (bitmap_nfree(bm) >= n)
+    {
+        long start = bitmap_find_run(bm, from, n);
+        if (start == -1)
+        {
+            if (wrapped)
+                return -1;
+            wrapped = true;
+            from = 0;
+            continue;
+        }
+
+        size_t got = bitmap_alloc_at(bm, start, n);
+        if (got == n)
+        {
+            __atomic_store_n(cursor, start + n < bm->nbits ? start + n : 0, __ATOMIC_RELAXED);
+            return start;
+        }
+        // Another thread took part of the run first: hand back the rest and look on past it
+        bitmap_clear_run(bm, start, got);
+        from = start + got + 1;
+    }
+    return -1;
+}
+
+size_t bitmap_alloc_at(struct wfs_bitmap *bm, size_t start, size_t n)
+{
+    if (start >= bm->nbits)
+    {
+        return 0;
+    }
+    if (n > bm->nbits - start)
+    {
+        n = bm->nbits - start;
+    }
+
+    // Claim only what looks clear, a word at a time. Bits another thread sets meanwhile cut the
+    // run short there, and whatever this call took beyond them goes back.
+    size_t pos = start + bm->shift;
+    size_t end = pos + clear_run_length(bm, start, n);
+    size_t got = 0;
+    while (pos < end)
+    {
+        size_t w = pos / 64;
+        uint64_t want = bit_range(pos % 64, min(end - w * 64, 64));
+        uint64_t taken = set_bits(bm, w, want);
+        if (taken != want)
+        {
+            uint64_t keep = taken & bit_range(pos % 64, __builtin_ctzl(want & ~taken));
+            clear_bits(bm, w, taken & ~keep);
+            return got + __builtin_popcountl(keep);
+        }
+        got += __builtin_popcountl(want);
+        pos = (w + 1) * 64;
+    }
+    return got;
+}
+
+long bitmap_alloc_near(struct wfs_bitmap *bm, size_t goal)
+{
+    // The cursor is left alone: it belongs to allocations that have no goal of their own
+    return alloc_from(bm, goal);
+}
@@ -0,0 +1,78 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Allocator over one of the on-disk bitmaps. Bit i of the bitmap is bit
+  i % 8 of byte i / 8, as mkfs writes it. The mapped image is read and
+  updated 64 bits at a time, so `words` is the bitmap start rounded down to
+  an 8-byte boundary and `shift` is the number of bits that precede bit 0
+  in the first word. Updates are atomic fetch_or/fetch_and on a word. The
+  first and last words may share bytes with whatever lies around the
+  bitmap, so those two are read and updated a byte at a time, touching
+  only the bitmap's own bytes; searches treat the foreign bits as set.
+
+  No lock is needed. A bit is claimed by whichever thread's fetch_or finds
+  it clear, and a search that loses the race looks on past it. nfree is
+  updated atomically with the bits.
+
+  Two in-memory summaries sit on top of the words, each a tree of bitmaps
+  with 64-way fan-out: a set bit at level 0 means the bitmap word below
+  satisfies the summary's condition, and a set bit at level k + 1 means the
+  level k word below is non-zero. Walking one finds the next qualifying
+  word in O(log64 n) steps however much full space lies in between.
+  Summaries of a word that other threads are changing may briefly lag it:
+  whoever changes a word last brings them up to date, and searches check
+  every word a summary leads them to.
+*/
+#define BITMAP_MAX_LEVELS (8)
+
+struct bitmap_summary {
+    int levels;
+    uint64_t *bits[BITMAP_MAX_LEVELS];
+    size_t nwords[BITMAP_MAX_LEVELS];
+};
+
+struct wfs_bitmap {
+    uint64_t *words; /* Aligned view of the bitmap */
+    size_t shift;    /* Bits of words[0] that precede bit 0 */
+    size_t nbits;    /* Number of tracked bits */
+    size_t nfree;    /* Clear bits among them; read it with bitmap_nfree */
+    size_t hint;     /* Next-fit cursor for callers without one of their own */
+
+    struct bitmap_summary has_free; /* Words with at least one clear bit */
+    struct bitmap_summary all_free; /* Words with every bit clear */
+};
+
+/* Returns 0, or -1 if the summaries cannot be allocated */
+int bitmap_init(struct wfs_bitmap *bm, void *base, size_t nbits);
+void bitmap_destroy(struct wfs_bitmap *bm);
+
+size_t bitmap_nfree(const struct wfs_bitmap *bm);
+bool bitmap_test(const struct wfs_bitmap *bm, size_t bit);
+/* Set or clear one bit, returning whether this call changed it */
+bool bitmap_set(struct wfs_bitmap *bm, size_t bit);
+bool bitmap_clear(struct wfs_bitmap *bm, size_t bit);
+/* Clears bits [start, start + n) a word at a time rather than bit by bit; returns how many were set */
+size_t bitmap_clear_run(struct wfs_bitmap *bm, size_t start, size_t n);
+
+/*
+  The allocating calls take a next-fit cursor, which they start from and
+  move past what they allocate. A thread that passes its own cursor keeps
+  to its own part of the bitmap; NULL means the bitmap's shared hint.
+*/
+
+/* Sets the first clear bit at or after the cursor, wrapping once; returns it or -1 when full */
+long bitmap_alloc(struct wfs_bitmap *bm, size_t *cursor);
+
+/* Returns the start of the first run of n clear bits at or after from, or -1 */
+long bitmap_find_run(const struct wfs_bitmap *bm, size_t from, size_t n);
+
+/* Sets a run of n clear bits at or after the cursor, wrapping once; returns its start or -1 */
+long bitmap_alloc_run(struct wfs_bitmap *bm, size_t n, size_t *cursor);
+
+/* Sets the clear bits from start on, stopping at the first set bit or after n; returns how many */
+size_t bitmap_alloc_at(struct wfs_bitmap *bm, size_t start, size_t n);
+
+/* Sets the first clear bit at or after goal, wrapping once, without moving the cursor; returns it or -1 */
+long bitmap_alloc_near(struct wfs_bitmap *bm, size_t goal);
@@ -0,0 +1,554 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "image.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Copies of metadata keep the image's alignment modulo this, as the bitmaps read whole words
+#define REGION_ALIGN (64)
+// Kept metadata is compared with what the image holds, and written back, this many bytes at a time
+#define REGION_CHUNK (4096)
+// How often the cache backend writes back on its own, as the kernel would a mapping's dirty pages
+#define WRITEBACK_SECONDS (5)
+
+static char *mapping; // The whole image, with the mmap backend
+static off_t image_size;
+static int image_fd = -1;
+static size_t block_size;
+
+// A stretch of metadata held in memory by the cache backend
+struct region
+{
+    off_t start;
+    off_t end;
+    char *data;  // Byte start of the region
+    char *base;  // What to free
+    char *saved; // The region as the image last had it, so only chunks that changed are written
+};
+
+static struct region *regions;
+static size_t nregions;
+
+struct cache_entry
+{
+    struct cache_entry *next; // Hash chain
+    off_t block;              // Image offset of the cached block
+    size_t slot;              // Index in slots
+    int pins;                 // Outstanding image_data calls that returned this block
+    bool referenced;          // CLOCK bit: used since the hand last passed
+    bool dirty;               // Written since it was last read or written back
+    unsigned writers;         // How many of the pins are for writing
+    bool reading;             // Being read in or zeroed; lookups wait for io_done rather than pin it
+    bool writing;             // Being written back: not evicted, and pinned for writing only once done
+    char *data;
+};
+
+// cache_lock guards the hash, the slots and the entries' fields, but no read or write of the image
+// is made while holding it: an entry is marked reading or writing instead and the lock dropped.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_done = PTHREAD_COND_INITIALIZER; // Some entry stopped reading or writing
+static struct cache_entry **slots; // Every cached block, in CLOCK order
+static size_t nslots;
+static size_t slots_cap;
+static size_t capacity; // The configured cache size in blocks
+static size_t hand;
+static struct cache_entry **buckets;
+static int bucket_bits;
+
+// Blocks a thread has pinned since its last image_release
+struct pin
+{
+    struct cache_entry *entry;
+    bool write;
+};
+
+struct pin_list
+{
+    size_t count;
+    size_t cap;
+    struct pin pins[];
+};
+
+static pthread_key_t pins_key;
+
+// Writeback: one pass at a time, from image_writeback, image_sync or the thread that runs every few seconds
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static bool flusher_running;
+static bool flusher_stop;
+static bool flusher_kicked; // Asked by image_writeback to start a pass before the timer runs out
+static void *flusher_main(void *arg);
+
+// Reads or writes n bytes at offset; the image never ends early, so failing to is fatal
+static void image_io(bool write, char *buf, size_t n, off_t offset)
+{
+    while (n > 0)
+    {
+        ssize_t done = write ? pwrite(image_fd, buf, n, offset) : pread(image_fd, buf, n, offset);
+        if (done == -1 && errno == EINTR)
+            continue;
+        if (done <= 0)
+        {
+            fprintf(stderr, "%s the disk image at %lld: %s\n", write ? "Writing" : "Reading", (long long)offset,
+                    done == 0 ? "unexpected end of file" : strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        buf += done;
+        n -= done;
+        offset += done;
+    }
+}
+
+static void out_of_memory(void)
+{
+    fprintf(stderr, "Out of memory for the block cache\n");
+    exit(EXIT_FAILURE);
+}
+
+int image_open(int fd, off_t size, size_t bsize, size_t cache_blocks)
+{
+    image_size = size;
+    block_size = bsize;
+    if (cache_blocks == 0)
+    {
+        mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = NULL;
+            return -1;
+        }
+        close(fd); // The mapping keeps the image open
+        return 0;
+    }
+
+    capacity = cache_blocks;
+    bucket_bits = 1;
+    while ((1UL << bucket_bits) < capacity && bucket_bits < 32)
+    {
+        bucket_bits++;
+    }
+    buckets = calloc(1UL << bucket_bits, sizeof(struct cache_entry *));
+    slots_cap = capacity;
+    slots = malloc(slots_cap * sizeof(struct cache_entry *));
+    if (!buckets || !slots)
+    {
+        free(buckets);
+        free(slots);
+        errno = ENOMEM;
+        return -1;
+    }
+    int err = pthread_key_create(&pins_key, free);
+    if (err != 0)
+    {
+        free(buckets);
+        free(slots);
+        errno = err;
+        return -1;
+    }
+    image_fd = fd;
+    return 0;
+}
+
+void image_start(void)
+{
+    // Without it nothing would reach the image before it is closed
+    if (!mapping && image_fd != -1 && !flusher_running)
+        flusher_running = pthread_create(&flusher, NULL, flusher_main, NULL) == 0;
+}
+
+bool image_cached(void)
+{
+    return !mapping;
+}
+
+int image_keep(off_t start, off_t end)
+{
+    if (mapping)
+        return 0;
+    struct region *grown = realloc(regions, (nregions + 1) * sizeof(struct region));
+    if (!grown)
+        return -1;
+    regions = grown;
+    char *base;
+    int err = posix_memalign((void **)&base, REGION_ALIGN, start % REGION_ALIGN + (end - start));
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    char *saved = malloc(end - start);
+    if (!saved)
+    {
+        free(base);
+        return -1;
+    }
+    struct region *r = &regions[nregions++];
+    *r = (struct region){start, end, base + start % REGION_ALIGN, base, saved};
+    image_io(false, r->data, end - start, start);
+    memcpy(r->saved, r->data, end - start);
+    return 0;
+}
+
+void *image_at(off_t offset)
+{
+    if (mapping)
+        return mapping + offset;
+    // Only called while mounting, so a linear search will do
+    for (size_t i = 0; i < nregions; i++)
+    {
+        if (offset >= regions[i].start && offset < regions[i].end)
+            return regions[i].data + (offset - regions[i].start);
+    }
+    return NULL;
+}
+
+static struct cache_entry **bucket_of(off_t block)
+{
+    return &buckets[((uint64_t)block * 0x9E3779B97F4A7C15UL) >> (64 - bucket_bits)];
+}
+
+// Takes a clean block out of the hash, leaving the entry free for reuse
+static void cache_evict(struct cache_entry *e)
+{
+    struct cache_entry **link = bucket_of(e->block);
+    while (*link != e)
+    {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+}
+
+// Returns an unpinned block the hand has passed twice without its being used, or NULL if all are
+// pinned or being written back
+static struct cache_entry *cache_victim(void)
+{
+    // The first lap clears every referenced bit, so the second finds any unpinned block
+    for (size_t seen = 0; seen < 2 * nslots; seen++)
+    {
+        hand = hand < nslots ? hand : 0;
+        struct cache_entry *e = slots[hand++];
+        if (e->pins || e->writing)
+            continue;
+        if (e->referenced)
+        {
+            e->referenced = false;
+            continue;
+        }
+        return e;
+    }
+    return NULL;
+}
+
+static struct cache_entry *cache_new(void)
+{
+    if (nslots == slots_cap)
+    {
+        struct cache_entry **grown = realloc(slots, 2 * slots_cap * sizeof(struct cache_entry *));
+        if (!grown)
+            out_of_memory();
+        slots = grown;
+        slots_cap *= 2;
+    }
+    struct cache_entry *e = calloc(1, sizeof(struct cache_entry));
+    if (!e || posix_memalign((void **)&e->data, REGION_ALIGN, block_size) != 0)
+        out_of_memory();
+    e->slot = nslots;
+    slots[nslots++] = e;
+    return e;
+}
+
+// Writes back a dirty victim with the lock dropped; the caller then looks for a victim again, as
+// anything may have changed meanwhile
+static void cache_clean(struct cache_entry *e)
+{
+    e->writing = true;
+    e->dirty = false; // Set again by any writer that releases it meanwhile
+    pthread_mutex_unlock(&cache_lock);
+    image_io(true, e->data, block_size, e->block);
+    pthread_mutex_lock(&cache_lock);
+    e->writing = false;
+    pthread_cond_broadcast(&io_done);
+}
+
+static void cache_drop(struct cache_entry *e)
+{
+    cache_evict(e);
+    struct cache_entry *last = slots[--nslots];
+    slots[e->slot] = last;
+    last->slot = e->slot;
+    free(e->data);
+    free(e);
+}
+
+// Returns the cached block at block, pinned, reading it in unless the caller overwrites all of it
+static struct cache_entry *cache_get(off_t block, bool read, bool write)
+{
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry **bucket = bucket_of(block);
+    struct cache_entry *e;
+    for (;;)
+    {
+        e = *bucket;
+        while (e && e->block != block)
+        {
+            e = e->next;
+        }
+        if (e && (e->reading || (write && e->writing)))
+        {
+            pthread_cond_wait(&io_done, &cache_lock);
+            continue;
+        }
+        if (e)
+        {
+            e->pins++;
+            e->writers += write;
+            e->referenced = true;
+            pthread_mutex_unlock(&cache_lock);
+            return e;
+        }
+
+        e = nslots < capacity ? NULL : cache_victim();
+        if (!e || !e->dirty)
+            break;
+        cache_clean(e);
+    }
+
+    if (e)
+        cache_evict(e);
+    else
+        e = cache_new(); // Filling up, or every block is pinned or being written
+    // Enter the block before filling it, so other threads wanting it wait instead of reading it too
+    e->block = block;
+    e->next = *bucket;
+    *bucket = e;
+    e->pins = 1;
+    e->writers = write;
+    e->referenced = true;
+    e->reading = true;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (read)
+        image_io(false, e->data, block_size, block);
+    else
+        memset(e->data, 0, block_size);
+
+    pthread_mutex_lock(&cache_lock);
+    e->reading = false;
+    pthread_cond_broadcast(&io_done);
+    pthread_mutex_unlock(&cache_lock);
+    return e;
+}
+
+static void pin_add(struct cache_entry *e, bool write)
+{
+    struct pin_list *list = pthread_getspecific(pins_key);
+    if (!list || list->count == list->cap)
+    {
+        size_t cap = list ? list->cap * 2 : 64;
+        struct pin_list *grown = realloc(list, sizeof(struct pin_list) + cap * sizeof(struct pin));
+        if (!grown)
+            out_of_memory();
+        if (!list)
+            grown->count = 0;
+        grown->cap = cap;
+        list = grown;
+        pthread_setspecific(pins_key, list);
+    }
+    list->pins[list->count++] = (struct pin){e, write};
+}
+
+void *image_data(off_t block_ptr, off_t offset, size_t *len, enum image_access access)
+{
+    if (mapping)
+        return mapping + block_ptr + offset;
+    size_t skip = offset % block_size;
+    *len = min(*len, block_size - skip);
+    bool whole = access == IMAGE_OVERWRITE && skip == 0 && *len == block_size;
+    struct cache_entry *e = cache_get(block_ptr + offset - skip, !whole, access != IMAGE_READ);
+    pin_add(e, access != IMAGE_READ);
+    return e->data + skip;
+}
+
+void *image_block(off_t block_ptr, enum image_access access)
+{
+    size_t len = block_size;
+    return image_data(block_ptr, 0, &len, access);
+}
+
+void image_release(void)
+{
+    if (mapping)
+        return;
+    struct pin_list *list = pthread_getspecific(pins_key);
+    if (!list || list->count == 0)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < list->count; i++)
+    {
+        list->pins[i].entry->pins--;
+        list->pins[i].entry->writers -= list->pins[i].write;
+        list->pins[i].entry->dirty |= list->pins[i].write;
+    }
+    list->count = 0;
+    // Give back the blocks taken while every block was pinned
+    while (nslots > capacity)
+    {
+        struct cache_entry *e = cache_victim();
+        if (!e)
+            break;
+        if (e->dirty)
+            cache_clean(e);
+        else
+            cache_drop(e);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Writes back the dirty blocks and whatever chunks of the kept metadata changed. Blocks still
+// pinned for writing are left for the next pass, as they are only marked dirty once released.
+static void image_flush(void)
+{
+    pthread_mutex_lock(&writeback_lock);
+    // Mark what is dirty now as being written, which keeps it from being evicted, and write it all
+    // with the lock dropped
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry **batch = malloc((nslots ? nslots : 1) * sizeof(struct cache_entry *));
+    if (!batch)
+        out_of_memory();
+    size_t n = 0;
+    for (size_t i = 0; i < nslots; i++)
+    {
+        if (slots[i]->dirty && !slots[i]->writing && !slots[i]->writers)
+        {
+            slots[i]->writing = true;
+            slots[i]->dirty = false;
+            batch[n++] = slots[i];
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    for (size_t i = 0; i < n; i++)
+    {
+        image_io(true, batch[i]->data, block_size, batch[i]->block);
+    }
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < n; i++)
+    {
+        batch[i]->writing = false;
+    }
+    pthread_cond_broadcast(&io_done);
+    pthread_mutex_unlock(&cache_lock);
+    free(batch);
+
+    // Requests go on changing the metadata meanwhile, as they would a mapping being written back
+    for (size_t i = 0; i < nregions; i++)
+    {
+        struct region *r = &regions[i];
+        for (off_t pos = r->start; pos < r->end;)
+        {
+            off_t next = min((pos / REGION_CHUNK + 1) * REGION_CHUNK, r->end);
+            char *now = r->data + (pos - r->start);
+            char *saved = r->saved + (pos - r->start);
+            if (memcmp(now, saved, next - pos) != 0)
+            {
+                memcpy(saved, now, next - pos);
+                image_io(true, saved, next - pos, pos);
+            }
+            pos = next;
+        }
+    }
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+static void *flusher_main(void *arg)
+{
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stop)
+    {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += WRITEBACK_SECONDS;
+        int err = 0;
+        while (!flusher_stop && !flusher_kicked && err != ETIMEDOUT)
+        {
+            err = pthread_cond_timedwait(&flusher_wake, &flusher_lock, &until);
+        }
+        if (!flusher_stop)
+        {
+            // Kicks that come in during the pass are served by the next one
+            flusher_kicked = false;
+            pthread_mutex_unlock(&flusher_lock);
+            image_flush();
+            pthread_mutex_lock(&flusher_lock);
+        }
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+void image_writeback(void)
+{
+    if (mapping || !flusher_running)
+        return; // Stores into a mapping are in the page cache already
+    pthread_mutex_lock(&flusher_lock);
+    flusher_kicked = true;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&flusher_lock);
+}
+
+int image_sync(void)
+{
+    if (mapping)
+        return msync(mapping, image_size, MS_SYNC);
+    image_flush();
+    return fsync(image_fd);
+}
+
+int image_close(void)
+{
+    if (mapping)
+    {
+        int ret = munmap(mapping, image_size);
+        mapping = NULL;
+        return ret;
+    }
+    if (flusher_running)
+    {
+        pthread_mutex_lock(&flusher_lock);
+        flusher_stop = true;
+        pthread_cond_signal(&flusher_wake);
+        pthread_mutex_unlock(&flusher_lock);
+        pthread_join(flusher, NULL);
+        flusher_running = flusher_stop = false;
+    }
+    image_flush();
+    while (nslots > 0)
+    {
+        cache_drop(slots[nslots - 1]);
+    }
+    for (size_t i = 0; i < nregions; i++)
+    {
+        free(regions[i].base);
+        free(regions[i].saved);
+    }
+    free(regions);
+    free(slots);
+    free(buckets);
+    regions = NULL;
+    slots = NULL;
+    buckets = NULL;
+    nregions = slots_cap = hand = 0;
+    free(pthread_getspecific(pins_key));
+    pthread_key_delete(pins_key);
+    int ret = close(image_fd);
+    image_fd = -1;
+    return ret;
+}
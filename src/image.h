@@ -0,0 +1,68 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+  Access to the disk image, through one of two backends chosen when it is
+  opened. The mmap backend maps the whole image MAP_SHARED and hands out
+  pointers into the mapping. The cache backend keeps the image on the file
+  descriptor and moves data with pread/pwrite:
+
+  - Metadata (superblock, group descriptors, bitmaps and inode tables) is
+    read into memory whole by image_keep. Writeback compares it with what
+    the image holds and writes only the chunks that changed.
+  - Data blocks go through a cache of a fixed number of blocks with CLOCK
+    eviction. A block stays in the cache, at the same address, while any
+    thread has it pinned. Blocks pinned for writing are marked dirty when
+    they are released and written back when evicted or flushed. The lock
+    over the cache is never held across a read or write of the image.
+  - A thread writes everything back every few seconds, as the kernel would
+    a mapping's dirty pages. image_writeback has it start at once, and
+    image_sync writes everything back and waits for the disk.
+
+  image_data and image_block pin what they return until the calling thread
+  calls image_release, which it does once it is done with the request. The
+  cache may grow past its size while every block in it is pinned and shrinks
+  back when they are released. A failed read or write of the image ends the
+  process, as a fault in the mapping would.
+*/
+
+enum image_access {
+    IMAGE_READ,
+    IMAGE_WRITE,
+    IMAGE_OVERWRITE, /* Writes every byte asked for, so whole blocks need not be read first */
+};
+
+/* Opens the image on fd with the mmap backend, or with a cache of cache_blocks blocks
+   of block_size bytes if cache_blocks is not 0. Takes over fd. Returns 0, or -1 with errno set. */
+int image_open(int fd, off_t size, size_t block_size, size_t cache_blocks);
+/* Starts the thread that writes the cache back every few seconds; a no-op when mapped. Threads do
+   not survive fork, so this comes once the process has daemonized. */
+void image_start(void);
+/* Writes everything back and releases the image; returns 0, or -1 with errno set */
+int image_close(void);
+/* Whether the image is read through the cache rather than mapped */
+bool image_cached(void);
+/* Starts writing back what the cache holds without waiting for it; a no-op when mapped */
+void image_writeback(void);
+/* Writes everything through to the disk; returns 0, or -1 with errno set */
+int image_sync(void);
+
+/* Keeps bytes [start, end) in memory for image_at; calls must come in order and not overlap.
+   Returns 0, or -1 if there is not enough memory. */
+int image_keep(off_t start, off_t end);
+/* Returns a pointer to offset within what was kept, or NULL if it was not */
+void *image_at(off_t offset);
+
+/*
+  Returns a pointer to offset bytes into the run of data blocks starting at
+  block_ptr and trims *len to how much of the run lies contiguously behind
+  it: all of it when mapped, up to the end of the block when cached. With
+  IMAGE_OVERWRITE a block the range covers whole starts out zeroed in the
+  cache instead of being read.
+*/
+void *image_data(off_t block_ptr, off_t offset, size_t *len, enum image_access access);
+/* Returns the data block at block_ptr */
+void *image_block(off_t block_ptr, enum image_access access);
+/* Drops the calling thread's pins, marking the blocks it wrote dirty */
+void image_release(void);
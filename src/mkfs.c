@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For fallocate
 #include <sys/types.h>
 #include "wfs.h"
 #include <stdio.h>
@@ -5,12 +6,48 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
-int roundup(int num, int factor)
+off_t roundup(off_t num, off_t factor)
 {
     return num % factor == 0 ? num : num + (factor - (num % factor));
 }
 
+// Makes [offset, offset + length) of the image read as zeros, preferably by punching it out
+int zero_range(int fd, off_t offset, off_t length)
+{
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+    {
+        return 0;
+    }
+
+    // The host filesystem cannot punch holes, so write the zeros out
+    static char zeros[65536];
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return -1;
+    off_t end = offset + length;
+    end = end < st.st_size ? end : st.st_size; // Past the end of the image reads as zero already
+    for (off_t pos = offset; pos < end; pos += sizeof(zeros))
+    {
+        size_t n = end - pos < (off_t)sizeof(zeros) ? end - pos : sizeof(zeros);
+        if (pwrite(fd, zeros, n, pos) != (ssize_t)n)
+            return -1;
+    }
+    return 0;
+}
+
+// Lays out a group's bitmaps, inodes and data blocks from byte offset start, returning where it ends
+off_t layout_group(struct wfs_group_desc *gd, off_t start, int num_inodes, int num_data_blocks,
+                   int inode_size, int block_size, off_t align)
+{
+    gd->i_bitmap_ptr = start;
+    gd->d_bitmap_ptr = gd->i_bitmap_ptr + (num_inodes / 8);
+    gd->i_blocks_ptr = roundup(gd->d_bitmap_ptr + (num_data_blocks / 8), align);
+    gd->d_blocks_ptr = roundup(gd->i_blocks_ptr + ((off_t)num_inodes * inode_size), align);
+    return gd->d_blocks_ptr + (off_t)num_data_blocks * block_size;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -19,11 +56,15 @@ int main(int argc, char *argv[])
     int num_data_blocks = 0;
     int inode_bitmap_size = 0;
     int data_bitmap_size = 0;
+    size_t features = 0;
+    int block_size = BLOCK_SIZE;
+    int inode_size = 0; // A block per inode unless -I packs them
+    int blocks_per_group = 0; // One group spanning the image unless -G splits it
 
     // Parse command line arguments
-    if (argc != 7)
+    if (argc < 7)
     {
-        fprintf(stderr, "Usage: %s -d disk_img -i num_inodes -b num_data_blocks\n", argv[0]);
+        fprintf(stderr, "Usage: %s -d disk_img -i num_inodes -b num_data_blocks [-B block_size] [-I inode_size] [-G blocks_per_group] [-H] [-E] [-D]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -41,6 +82,33 @@ int main(int argc, char *argv[])
         {
             num_data_blocks = atoi(argv[++i]);
         }
+        else if (strcmp(argv[i], "-B") == 0)
+        {
+            block_size = atoi(argv[++i]);
+            features |= WFS_FEATURE_BLOCK_SIZE;
+        }
+        else if (strcmp(argv[i], "-I") == 0)
+        {
+            inode_size = atoi(argv[++i]);
+            features |= WFS_FEATURE_INODE_SIZE;
+        }
+        else if (strcmp(argv[i], "-G") == 0)
+        {
+            blocks_per_group = atoi(argv[++i]);
+            features |= WFS_FEATURE_GROUPS;
+        }
+        else if (strcmp(argv[i], "-H") == 0)
+        {
+            features |= WFS_FEATURE_DIR_INDEX;
+        }
+        else if (strcmp(argv[i], "-E") == 0)
+        {
+            features |= WFS_FEATURE_EXTENTS;
+        }
+        else if (strcmp(argv[i], "-D") == 0)
+        {
+            features |= WFS_FEATURE_INLINE_DATA;
+        }
     }
 
     if (!disk_path || num_inodes <= 0 || num_data_blocks <= 0)
@@ -48,13 +116,71 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Invalid arguments\n");
         exit(EXIT_FAILURE);
     }
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)))
+    {
+        fprintf(stderr, "Block size must be a power of two from %d to %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if (!(features & WFS_FEATURE_INODE_SIZE))
+    {
+        inode_size = block_size;
+    }
+    else if (inode_size < (int)sizeof(struct wfs_inode) || inode_size > block_size || (inode_size & (inode_size - 1)))
+    {
+        fprintf(stderr, "Inode size must be a power of two of at least %zu bytes and at most the block size\n", sizeof(struct wfs_inode));
+        exit(EXIT_FAILURE);
+    }
+    if ((features & WFS_FEATURE_GROUPS) && blocks_per_group <= 0)
+    {
+        fprintf(stderr, "Blocks per group must be positive\n");
+        exit(EXIT_FAILURE);
+    }
     num_inodes = roundup(num_inodes, 32);
     num_data_blocks = roundup(num_data_blocks, 32);
 
-    off_t i_bitmap_ptr = sizeof(struct wfs_sb);
-    off_t d_bitmap_ptr = i_bitmap_ptr + (num_inodes / 8);
-    off_t i_blocks_ptr = d_bitmap_ptr + (num_data_blocks / 8);
-    off_t d_blocks_ptr = i_blocks_ptr + (num_inodes * BLOCK_SIZE);
+    // Split the data blocks into groups and share the inodes out evenly between them
+    int num_groups = 1;
+    int inodes_per_group = num_inodes;
+    if (features & WFS_FEATURE_GROUPS)
+    {
+        blocks_per_group = roundup(blocks_per_group, 32);
+        num_groups = (num_data_blocks + blocks_per_group - 1) / blocks_per_group;
+        inodes_per_group = roundup((num_inodes + num_groups - 1) / num_groups, 32);
+        num_inodes = inodes_per_group * num_groups;
+    }
+    else
+    {
+        blocks_per_group = num_data_blocks;
+    }
+
+    off_t align = 1;
+    if (features & WFS_FEATURE_BLOCK_SIZE)
+    {
+        // Start the inode and data regions on a page boundary so that no block straddles two pages
+        long page_size = sysconf(_SC_PAGESIZE);
+        align = block_size > page_size ? block_size : page_size;
+    }
+
+    // Plain images keep the original superblock so older tools can read them
+    off_t gd_ptr = features ? sizeof(struct wfs_sb) : WFS_SB_LEGACY_SIZE;
+    struct wfs_group_desc *gdt = calloc(num_groups, sizeof(struct wfs_group_desc));
+    if (!gdt)
+    {
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    off_t end = gd_ptr + ((features & WFS_FEATURE_GROUPS) ? num_groups * sizeof(struct wfs_group_desc) : 0);
+    for (int g = 0; g < num_groups; g++)
+    {
+        int blocks = g < num_groups - 1 ? blocks_per_group : num_data_blocks - g * blocks_per_group;
+        end = layout_group(&gdt[g], end, inodes_per_group, blocks, inode_size, block_size, align);
+        gdt[g].free_inodes = g == 0 ? inodes_per_group - 1 : inodes_per_group; // Less the root
+        gdt[g].free_blocks = blocks;
+    }
+    off_t i_bitmap_ptr = gdt[0].i_bitmap_ptr;
+    off_t d_bitmap_ptr = gdt[0].d_bitmap_ptr;
+    off_t i_blocks_ptr = gdt[0].i_blocks_ptr;
+    off_t d_blocks_ptr = gdt[0].d_blocks_ptr;
 
     int fd = open(disk_path, O_RDWR | O_CREAT, 0644);
     if (fd == -1)
@@ -70,15 +196,54 @@ int main(int argc, char *argv[])
         .i_bitmap_ptr = i_bitmap_ptr,
         .d_bitmap_ptr = d_bitmap_ptr,
         .i_blocks_ptr = i_blocks_ptr,
-        .d_blocks_ptr = d_blocks_ptr};
+        .d_blocks_ptr = d_blocks_ptr,
+        .magic = WFS_MAGIC,
+        .features = features,
+        .block_size = block_size,
+        .inode_size = inode_size,
+        .free_inodes = num_inodes - 1,
+        .free_blocks = num_data_blocks,
+        .fresh_from = 0};
+    if (features & WFS_FEATURE_GROUPS)
+    {
+        sb.num_groups = num_groups;
+        sb.inodes_per_group = inodes_per_group;
+        sb.blocks_per_group = blocks_per_group;
+        sb.gd_ptr = gd_ptr;
+    }
+    // Clear every data region so that wfs can hand out blocks it has never used without zeroing
+    // them. Should that fail, the image records that no block is known to be zero.
+    if (features)
+    {
+        for (int g = 0; g < num_groups; g++)
+        {
+            int blocks = g < num_groups - 1 ? blocks_per_group : num_data_blocks - g * blocks_per_group;
+            if (zero_range(fd, gdt[g].d_blocks_ptr, (off_t)blocks * block_size) != 0)
+            {
+                perror("Failed to clear data blocks");
+                gdt[g].fresh_from = blocks;
+                sb.fresh_from = num_data_blocks;
+            }
+        }
+    }
+
     // Write the superblock to the disk image
-    if (write(fd, &sb, sizeof(sb)) != sizeof(sb))
+    if (write(fd, &sb, gd_ptr) != gd_ptr)
     {
         perror("Failed to write superblock");
         close(fd);
         exit(EXIT_FAILURE);
     }
 
+    if ((features & WFS_FEATURE_GROUPS) &&
+        write(fd, gdt, num_groups * sizeof(struct wfs_group_desc)) != (ssize_t)(num_groups * sizeof(struct wfs_group_desc)))
+    {
+        perror("Failed to write group descriptors");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    free(gdt);
+
     // Zero out inode bitmap
     char *zero_buffer = calloc(1, inode_bitmap_size);
     if (!zero_buffer)
@@ -121,7 +286,8 @@ int main(int argc, char *argv[])
         .mtim = time(NULL),
         .ctim = time(NULL),
 
-        .blocks = {0} // Initialize all block pointers to 0
+        .blocks = {0}, // Initialize all block pointers to 0
+        .flags = (features & WFS_FEATURE_DIR_INDEX) ? WFS_INODE_DIR_INDEX : 0,
     };
 
     if (lseek(fd, i_blocks_ptr, SEEK_SET) == -1 ||
@@ -1,67 +1,282 @@
+#define _GNU_SOURCE // For SEEK_DATA and SEEK_HOLE
 #include <sys/types.h>
 #include "wfs.h"
-#include <fuse.h>
+#include "bitmap.h"
+#include "image.h"
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <stdbool.h>
-#include <sys/mman.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 
 int wfs_init(size_t num_inodes, size_t num_data_blocks, void *memory_start);
-static int wfs_getattr(const char *path, struct stat *stbuf);
-static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
-static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
-static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
-static int wfs_mknod(const char *path, mode_t mode, dev_t dev);
-static int wfs_mkdir(const char *path, mode_t mode);
-static int wfs_unlink(const char *path);
-static int wfs_rmdir(const char *path);
-
-// Map functions to fuse_operations
-static struct fuse_operations wfs_oper = {
-    .getattr = wfs_getattr,
-    .readdir = wfs_readdir,
-    .read = wfs_read,
-    .write = wfs_write,
-    .mknod = wfs_mknod,
-    .mkdir = wfs_mkdir,
-    .unlink = wfs_unlink,
-    .rmdir = wfs_rmdir};
+static void wfs_conn_init(void *userdata, struct fuse_conn_info *conn);
+static void wfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+static void wfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+static void wfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void wfs_statfs(fuse_req_t req, fuse_ino_t ino);
+static void wfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi);
+static void wfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi);
+static void wfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+static void wfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi);
+static void wfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void wfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
+static void wfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void wfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void wfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+static void wfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+static void wfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+static void wfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi);
+#endif
+static void wfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev);
+static void wfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+static void wfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+static void wfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+
+// Every request lets go of the image blocks it used once it has replied
+#define WFS_REQUEST(op, params, args) \
+    static void op##_request params   \
+    {                                 \
+        op args;                      \
+        image_release();              \
+    }
+
+WFS_REQUEST(wfs_lookup, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+WFS_REQUEST(wfs_forget, (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup), (req, ino, nlookup))
+WFS_REQUEST(wfs_getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+WFS_REQUEST(wfs_setattr, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi), (req, ino, attr, to_set, fi))
+WFS_REQUEST(wfs_statfs, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+WFS_REQUEST(wfs_readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, size, offset, fi))
+WFS_REQUEST(wfs_read, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, size, offset, fi))
+WFS_REQUEST(wfs_write, (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (req, ino, buf, size, offset, fi))
+WFS_REQUEST(wfs_write_buf, (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi), (req, ino, bufv, offset, fi))
+WFS_REQUEST(wfs_open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+WFS_REQUEST(wfs_create, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi), (req, parent, name, mode, fi))
+WFS_REQUEST(wfs_release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+WFS_REQUEST(wfs_flush, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+WFS_REQUEST(wfs_fsync, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi), (req, ino, datasync, fi))
+WFS_REQUEST(wfs_fallocate, (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi), (req, ino, mode, offset, length, fi))
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+WFS_REQUEST(wfs_lseek, (fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi), (req, ino, off, whence, fi))
+#endif
+WFS_REQUEST(wfs_mknod, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev), (req, parent, name, mode, rdev))
+WFS_REQUEST(wfs_mkdir, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode), (req, parent, name, mode))
+WFS_REQUEST(wfs_unlink, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+WFS_REQUEST(wfs_rmdir, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+
+// Map functions to fuse_lowlevel_ops
+static struct fuse_lowlevel_ops wfs_oper = {
+    .init = wfs_conn_init,
+    .lookup = wfs_lookup_request,
+    .forget = wfs_forget_request,
+    .getattr = wfs_getattr_request,
+    .setattr = wfs_setattr_request,
+    .statfs = wfs_statfs_request,
+    .readdir = wfs_readdir_request,
+    .read = wfs_read_request,
+    .write = wfs_write_request,
+    .write_buf = wfs_write_buf_request,
+    .open = wfs_open_request,
+    .create = wfs_create_request,
+    .release = wfs_release_request,
+    .flush = wfs_flush_request,
+    .fsync = wfs_fsync_request,
+    .fsyncdir = wfs_fsync_request,
+    .fallocate = wfs_fallocate_request,
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+    .lseek = wfs_lseek_request,
+#endif
+    .mknod = wfs_mknod_request,
+    .mkdir = wfs_mkdir_request,
+    .unlink = wfs_unlink_request,
+    .rmdir = wfs_rmdir_request};
+
+// FUSE reserves inode number 1 for the root, which is wfs inode 0
+#define WFS_INO(num) ((fuse_ino_t)(num) + 1)
+
+// How long the kernel may cache entries and attributes; every change goes through us
+#define WFS_TIMEOUT (1.0)
+
+// Size of the block cache used when the image cannot be mapped and -c was not given
+#define DEFAULT_CACHE_MIB (64)
 
 // Global variables
 char *disk_image_path;
 int global_fd;
-void *mapped_memory;
 struct wfs_sb sb;
-struct wfs_inode *inodes;
-char *inode_bitmap;
-char *data_bitmap;
-char *data_blocks; // Pointer to the data blocks section
+static int block_size = BLOCK_SIZE; // Bytes per block, from the superblock
+static int inode_size = BLOCK_SIZE; // Bytes per inode slot, from the superblock
+
+// An allocation group: a slice of the inodes and of the data blocks with bitmaps of its own.
+// Images without WFS_FEATURE_GROUPS are a single group spanning the whole image.
+struct alloc_group
+{
+    struct wfs_bitmap inode_bits; // Allocator state over the group's inode bitmap
+    struct wfs_bitmap data_bits;  // Allocator state over the group's data bitmap
+    struct wfs_bitmap avail_bits; // In-memory copy of data_bits that also has reserved blocks set; allocation searches this
+    char *inodes;                 // The group's first inode slot
+    off_t d_blocks_ptr;           // Byte offset of the group's first data block
+    size_t fresh_from;            // Data blocks from here on are unused since mkfs and read as zero
+};
+
+static struct alloc_group *groups;
+static size_t num_groups;
+static size_t inodes_per_group; // Inode n lives in group n / inodes_per_group
+static size_t blocks_per_group; // Data block index i lives in group i / blocks_per_group
+
+// The superblock and group descriptors in the image, when it has room for free counts, else NULL.
+// sb.free_inodes and sb.free_blocks are kept current either way.
+static struct wfs_sb *disk_sb;
+static struct wfs_group_desc *disk_gdt;
+static bool disk_fresh; // Whether the image records where its never-used blocks start
+
+// Dentry cache: maps (parent inode, component name) to inode numbers
+#define DCACHE_BUCKETS (4096)
+#define DCACHE_MAX_ENTRIES (65536)
+
+struct dcache_entry
+{
+    struct dcache_entry *next;
+    unsigned long hash;
+    int parent; // Parent directory inode number
+    int num;    // Inode number the key resolves to
+    char name[];
+};
+
+static struct dcache_entry *dcache[DCACHE_BUCKETS];
+static size_t dcache_count;
+static unsigned long dcache_generation; // Bumped on every flush
+
+#define DENTRIES_PER_BLOCK ((int)(block_size / sizeof(struct wfs_dentry)))
+#define PTRS_PER_BLOCK ((off_t)(block_size / sizeof(off_t)))
+// Files reach data through direct, indirect, double and triple indirect pointers
+#define FILE_MAX_BLOCKS (D_BLOCK + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+// Directories only use the direct and single indirect pointers
+#define DIR_MAX_BLOCKS (D_BLOCK + (int)PTRS_PER_BLOCK)
+
+// In-memory directory state, indexed by inode number
+struct dir_state
+{
+    bool complete;   // Every live entry is in the dcache, so a cache miss is authoritative
+    int free_hint;   // No free dentry slot exists below this index
+    int hash_blocks; // Table size of a hashed directory in blocks, 0 until first computed
+    int parent;      // Inode number of the directory holding this one, set when it is made or looked up
+};
+
+static struct dir_state *dir_states;
+
+// Records that fit in the extent tree root inside an inode, and in a node filling a block
+#define EXTENT_ROOT_MAX ((int)((N_BLOCKS * sizeof(off_t) - sizeof(struct wfs_extent_header)) / sizeof(struct wfs_extent)))
+#define EXTENT_NODE_MAX ((int)((block_size - sizeof(struct wfs_extent_header)) / sizeof(struct wfs_extent)))
+#define EXTENT_MAX_BLOCKS ((off_t)UINT32_MAX) // Logical block numbers are 32 bits
+
+// In-core state of an open regular file, shared by every handle on it through fuse_file_info->fh
+struct open_file
+{
+    int num;                // Inode number
+    int refcount;           // Handles currently open
+    bool unlinked;          // Freed on the last release rather than at unlink
+    struct wfs_extent *map; // Every mapped run of the file, sorted by logical block
+    int map_len;            // Runs in map
+    int map_cap;            // Runs map has room for
+    int cursor;             // Run the last lookup landed on, so sequential I/O finds it at once
+    off_t reserved;         // Blocks set aside for the file to grow into, taken only in avail_bits
+    uint32_t reserved_len;  // How many are left
+    uint32_t window;        // How many extra blocks the next fresh run sets aside
+};
+
+// A file taking a fresh run sets aside this many blocks beyond what it needs, doubling each time it
+// uses them all up, so files written side by side each grow in long runs rather than interleave
+#define RESERVE_MIN_BLOCKS (8)
+#define RESERVE_MAX_BLOCKS ((uint32_t)max(RESERVE_MIN_BLOCKS, (1 << 20) / block_size))
+
+static struct open_file **open_files; // Indexed by inode number, NULL when not open
+// Bumped each time an inode number is freed, so the kernel can tell a reused number from the
+// inode it may still hold from before; kept only for the mount, as the kernel forgets everything on unmount
+static uint32_t *inode_generations; // Indexed by inode number
+
+// Locking, for the multithreaded session loop. Each inode has a reader/writer lock over its slot,
+// its blocks and its open_file; a directory's lock also covers adding and removing its entries.
+// A parent is always locked before its child. dcache_lock guards the dcache and the directories'
+// complete flags and is never held while taking another lock. Allocation takes no lock at all:
+// the bitmaps, the free counts and the never-used marks are all updated atomically.
+static pthread_rwlock_t *inode_locks; // Indexed by inode number
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Each thread allocates from cursors of its own, one per group for inodes and one for data
+// blocks. The nth thread to allocate starts its cursors at fraction n of the way through each
+// group in the order 0, 1/2, 1/4, 3/4, 1/8, ..., so threads allocating at the same time claim
+// disjoint stretches of the bitmaps rather than contend for the same words.
+struct alloc_cursor
+{
+    size_t inode;
+    size_t data;
+};
+static pthread_key_t cursor_key;
+static size_t cursor_threads; // Threads that have set up their cursors so far
+
 // Function prototypes
-struct wfs_inode *find_inode_by_path(const char *path);
-int allocate_inode();
-int allocate_block();
-static int add_directory_entry(struct wfs_inode *parent_inode, int new_inode_num, const char *new_entry_name);
+static struct wfs_inode *inode_at(int num);
+static struct wfs_inode *inode_from_ino(fuse_ino_t ino);
+static int scan_directory(struct wfs_inode *dir_inode, const char *name, int *free_slot);
+static int check_new_entry(struct wfs_inode *parent_inode, const char *name, int *slot);
+static struct wfs_dentry *dir_block_alloc(struct wfs_inode *dir_inode, int b);
+static off_t inode_data_blocks(struct wfs_inode *inode);
+static void count_blocks(struct wfs_inode *inode, long delta);
+static int hashed_dir_lookup(struct wfs_inode *dir_inode, const char *name);
+static int hashed_dir_insert(struct wfs_inode *dir_inode, int new_inode_num, const char *name);
+static int hashed_dir_remove(struct wfs_inode *dir_inode, int inode_num, const char *name);
+static int dcache_lookup(int parent, const char *name);
+static void dcache_insert(int parent, const char *name, int num);
+static void dcache_remove(int parent, const char *name);
+int allocate_inode(struct wfs_inode *parent_inode, bool is_dir);
+off_t allocate_block(size_t group);
+static int add_directory_entry(struct wfs_inode *parent_inode, int slot, int new_inode_num, const char *new_entry_name);
 static int remove_directory_entry(struct wfs_inode *parent_inode, int inode_num, const char *entry_name);
-static void free_block(int block_num);
+static void free_block(off_t block_ptr);
+static void free_blocks(off_t block_ptr, size_t n);
+static void reserve_release(struct open_file *of);
+static void save_fresh(size_t g);
 static void free_inode(int inode_num);
+static void release_inode(struct wfs_inode *inode);
+static void release_blockmap(struct wfs_inode *inode);
 
 int main(int argc, char *argv[])
 {
     if (argc < 3)
     {
-        fprintf(stderr, "Usage: %s <disk_path> [FUSE options] <mount_point>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <disk_path> [-c cache_blocks] [FUSE options] <mount_point>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
     // Store the disk image path in a global variable
     disk_image_path = argv[1];
+
+    // -c reads and writes the image through a cache of that many blocks instead of mapping it
+    size_t cache_blocks = 0;
+    if (argc > 4 && strcmp(argv[2], "-c") == 0)
+    {
+        char *end;
+        cache_blocks = strtoul(argv[3], &end, 10);
+        if (*end != '\0' || cache_blocks == 0)
+        {
+            fprintf(stderr, "Invalid cache size %s\n", argv[3]);
+            exit(EXIT_FAILURE);
+        }
+        memmove(&argv[2], &argv[4], (argc - 3) * sizeof(char *)); // FUSE only sees its own options
+        argc -= 2;
+    }
     global_fd = open(disk_image_path, O_RDWR);
     if (global_fd == -1)
     {
@@ -77,584 +292,3099 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    // Map the entire file into memory
-    mapped_memory = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, global_fd, 0);
-    if (mapped_memory == MAP_FAILED)
+    // Read the superblock, which says how the rest of the image is laid out
+    if (pread(global_fd, &sb, sizeof(sb), 0) < (ssize_t)WFS_SB_LEGACY_SIZE)
+    {
+        fprintf(stderr, "Disk image is smaller than a superblock\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!WFS_SB_HAS(&sb, features) || sb.magic != WFS_MAGIC)
+    {
+        // Original layout: the bytes after the superblock belong to the inode bitmap
+        sb.magic = 0;
+        sb.features = 0;
+    }
+    if (sb.features & ~WFS_FEATURES_SUPPORTED)
+    {
+        fprintf(stderr, "Unsupported filesystem features %#lx\n", sb.features & ~WFS_FEATURES_SUPPORTED);
+        exit(EXIT_FAILURE);
+    }
+    if (sb.features & WFS_FEATURE_BLOCK_SIZE)
+    {
+        if (!WFS_SB_HAS(&sb, block_size) || sb.block_size < MIN_BLOCK_SIZE ||
+            sb.block_size > MAX_BLOCK_SIZE || (sb.block_size & (sb.block_size - 1)))
+        {
+            fprintf(stderr, "Invalid block size %zu\n", sb.block_size);
+            exit(EXIT_FAILURE);
+        }
+        block_size = sb.block_size;
+    }
+    inode_size = block_size;
+    if (sb.features & WFS_FEATURE_INODE_SIZE)
+    {
+        if (!WFS_SB_HAS(&sb, inode_size) || sb.inode_size < sizeof(struct wfs_inode) ||
+            sb.inode_size > (size_t)block_size || (sb.inode_size & (sb.inode_size - 1)))
+        {
+            fprintf(stderr, "Invalid inode size %zu\n", sb.inode_size);
+            exit(EXIT_FAILURE);
+        }
+        inode_size = sb.inode_size;
+    }
+    struct wfs_group_desc single = {sb.i_bitmap_ptr, sb.d_bitmap_ptr, sb.i_blocks_ptr, sb.d_blocks_ptr};
+    struct wfs_group_desc *gdt = &single;
+    num_groups = 1;
+    inodes_per_group = sb.num_inodes;
+    blocks_per_group = sb.num_data_blocks;
+    if (sb.features & WFS_FEATURE_GROUPS)
+    {
+        if (!WFS_SB_HAS(&sb, gd_ptr) || sb.num_groups == 0 || sb.inodes_per_group == 0 ||
+            sb.blocks_per_group == 0 || sb.inodes_per_group % 8 || sb.blocks_per_group % 8 ||
+            sb.num_inodes != sb.num_groups * sb.inodes_per_group ||
+            sb.num_data_blocks <= (sb.num_groups - 1) * sb.blocks_per_group ||
+            sb.num_data_blocks > sb.num_groups * sb.blocks_per_group ||
+            sb.gd_ptr + (off_t)(sb.num_groups * sizeof(struct wfs_group_desc)) > file_stat.st_size)
+        {
+            fprintf(stderr, "Invalid allocation groups\n");
+            exit(EXIT_FAILURE);
+        }
+        // A copy to lay out the groups by; the descriptors kept up to date are the image's own
+        size_t gdt_size = sb.num_groups * sizeof(struct wfs_group_desc);
+        gdt = malloc(gdt_size);
+        if (!gdt || pread(global_fd, gdt, gdt_size, sb.gd_ptr) != (ssize_t)gdt_size)
+        {
+            perror("Failed to read the group descriptors");
+            exit(EXIT_FAILURE);
+        }
+        num_groups = sb.num_groups;
+        inodes_per_group = sb.inodes_per_group;
+        blocks_per_group = sb.blocks_per_group;
+    }
+
+    if (image_open(global_fd, file_stat.st_size, block_size, cache_blocks) == -1)
     {
+        if (cache_blocks != 0)
+        {
+            perror("Failed to set up the block cache");
+            exit(EXIT_FAILURE);
+        }
+        // Too big for the address space we have: go through the cache instead
         perror("mmap");
+        cache_blocks = (size_t)DEFAULT_CACHE_MIB * 1024 * 1024 / block_size;
+        fprintf(stderr, "Using a block cache of %zu blocks instead\n", cache_blocks);
+        if (image_open(global_fd, file_stat.st_size, block_size, cache_blocks) == -1)
+        {
+            perror("Failed to set up the block cache");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    groups = calloc(num_groups, sizeof(struct alloc_group));
+    if (!groups)
+    {
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
+    for (size_t g = 0; g < num_groups; g++)
+    {
+        // Everything between the previous group's data and this group's is metadata
+        size_t num_blocks = min(blocks_per_group, sb.num_data_blocks - g * blocks_per_group);
+        off_t meta_start = g > 0 ? gdt[g - 1].d_blocks_ptr + (off_t)blocks_per_group * block_size : 0;
+        if (file_stat.st_size < gdt[g].d_blocks_ptr + (off_t)num_blocks * block_size ||
+            gdt[g].d_blocks_ptr < meta_start)
+        {
+            fprintf(stderr, "Disk image is smaller than its superblock says\n");
+            exit(EXIT_FAILURE);
+        }
+        if (image_keep(meta_start, gdt[g].d_blocks_ptr) == -1)
+        {
+            perror("Failed to read the image metadata");
+            exit(EXIT_FAILURE);
+        }
+        char *inode_bitmap = image_at(gdt[g].i_bitmap_ptr);
+        char *data_bitmap = image_at(gdt[g].d_bitmap_ptr);
+        groups[g].inodes = image_at(gdt[g].i_blocks_ptr);
+        groups[g].d_blocks_ptr = gdt[g].d_blocks_ptr;
+        if (!inode_bitmap || !data_bitmap || !groups[g].inodes)
+        {
+            fprintf(stderr, "Metadata of group %zu lies among data blocks\n", g);
+            exit(EXIT_FAILURE);
+        }
+        if (g == 0)
+        {
+            *inode_bitmap |= 0x01; // The root is always allocated
+        }
+        // Reservations only ever reach the copy, so the image never records blocks as used that no file holds
+        uint64_t *avail = calloc((num_blocks + 63) / 64, sizeof(uint64_t));
+        if (!avail)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(avail, data_bitmap, (num_blocks + 7) / 8);
+        if (bitmap_init(&groups[g].inode_bits, inode_bitmap, inodes_per_group) != 0 ||
+            bitmap_init(&groups[g].data_bits, data_bitmap, num_blocks) != 0 ||
+            bitmap_init(&groups[g].avail_bits, avail, num_blocks) != 0)
+        {
+            perror("bitmap_init");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (gdt != &single)
+    {
+        free(gdt);
+        gdt = image_at(sb.gd_ptr);
+        if (!gdt)
+        {
+            fprintf(stderr, "Group descriptors lie among data blocks\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    // Close the file descriptor
-    close(global_fd);
+    // The counts on disk only cache what the bitmaps say, so take them from the bitmaps and just
+    // report counts that had drifted, say after a crash or an older wfs
+    bool stale = false;
+    if (sb.magic == WFS_MAGIC && WFS_SB_HAS(&sb, free_blocks))
+    {
+        disk_sb = image_at(0);
+        disk_gdt = (sb.features & WFS_FEATURE_GROUPS) ? gdt : NULL;
+    }
+    sb.free_inodes = sb.free_blocks = 0;
+    for (size_t g = 0; g < num_groups; g++)
+    {
+        size_t free_inodes = bitmap_nfree(&groups[g].inode_bits);
+        size_t free_blocks = bitmap_nfree(&groups[g].data_bits);
+        sb.free_inodes += free_inodes;
+        sb.free_blocks += free_blocks;
+        if (disk_gdt)
+        {
+            stale |= disk_gdt[g].free_inodes != free_inodes || disk_gdt[g].free_blocks != free_blocks;
+            disk_gdt[g].free_inodes = free_inodes;
+            disk_gdt[g].free_blocks = free_blocks;
+        }
+    }
+    if (disk_sb)
+    {
+        stale |= disk_sb->free_inodes != sb.free_inodes || disk_sb->free_blocks != sb.free_blocks;
+        disk_sb->free_inodes = sb.free_inodes;
+        disk_sb->free_blocks = sb.free_blocks;
+    }
+    if (stale)
+    {
+        fprintf(stderr, "Free inode and block counts did not match the bitmaps and were recounted\n");
+    }
 
-    // Set superblock pointer
-    sb = *((struct wfs_sb *)mapped_memory);
-    inode_bitmap = (char *)mapped_memory + sb.i_bitmap_ptr;
-    data_bitmap = (char *)mapped_memory + sb.d_bitmap_ptr;
-    inodes = (struct wfs_inode *)((char *)mapped_memory + sb.i_blocks_ptr);
-    data_blocks = (char *)mapped_memory + sb.d_blocks_ptr; // Initialize pointer to data blocks
+    // Without a mark on disk no block is known to be zero. A block allocated past the mark means
+    // the mark was lost, say in a crash, so it is moved past every allocated block.
+    disk_fresh = disk_gdt || (disk_sb && WFS_SB_HAS(&sb, fresh_from));
+    for (size_t g = 0; g < num_groups; g++)
+    {
+        struct wfs_bitmap *bits = &groups[g].data_bits;
+        size_t mark = disk_gdt ? disk_gdt[g].fresh_from : disk_fresh ? disk_sb->fresh_from : bits->nbits;
+        mark = min(mark, bits->nbits);
+        for (size_t i = bits->nbits; i > mark; i--)
+        {
+            if (bitmap_test(bits, i - 1))
+            {
+                mark = i;
+                break;
+            }
+        }
+        groups[g].fresh_from = mark;
+        save_fresh(g);
+    }
 
-    inode_bitmap[0] |= 0x01;
-    // Pass the modified argv and argc to fuse_main
+    dir_states = calloc(sb.num_inodes, sizeof(struct dir_state));
+    open_files = calloc(sb.num_inodes, sizeof(struct open_file *));
+    inode_locks = calloc(sb.num_inodes, sizeof(pthread_rwlock_t));
+    inode_generations = calloc(sb.num_inodes, sizeof(uint32_t));
+    if (!dir_states || !open_files || !inode_locks || !inode_generations)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t n = 0; n < sb.num_inodes; n++)
+    {
+        pthread_rwlock_init(&inode_locks[n], NULL);
+    }
+    if (pthread_key_create(&cursor_key, free) != 0)
+    {
+        perror("pthread_key_create");
+        exit(EXIT_FAILURE);
+    }
+    // Pass the modified argv and argc to FUSE
     argv++;
     argc--;
 
-    // Call fuse_main with modified arguments
-    int fuse_ret = fuse_main(argc, argv, &wfs_oper, NULL);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    int fuse_ret = EXIT_FAILURE;
+    if (fuse_parse_cmdline(&args, &opts) == -1 || !opts.mountpoint)
+    {
+        fprintf(stderr, "Missing mount point\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Mount and serve requests until unmounted, as fuse_main does for the high-level API
+    struct fuse_session *session = fuse_session_new(&args, &wfs_oper, sizeof(wfs_oper), NULL);
+    if (session)
+    {
+        if (fuse_set_signal_handlers(session) != -1)
+        {
+            if (fuse_session_mount(session, opts.mountpoint) != -1)
+            {
+                if (fuse_daemonize(opts.foreground) != -1)
+                {
+                    // Only the calling thread survives the fork into the background, so the cache's
+                    // writeback thread starts here rather than in image_open
+                    image_start();
+                    // Requests are served by a pool of threads unless -s was given
+                    int loop_ret = opts.singlethread ? fuse_session_loop(session)
+                                                     : fuse_session_loop_mt(session, opts.clone_fd);
+                    fuse_ret = loop_ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+                fuse_session_unmount(session);
+            }
+            fuse_remove_signal_handlers(session);
+        }
+        fuse_session_destroy(session);
+    }
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
 
-    // Unmap the memory
-    if (munmap(mapped_memory, file_stat.st_size) == -1)
+    // Unmap the image, or write back what the cache holds
+    if (image_close() == -1)
     {
-        perror("munmap");
+        perror("image_close");
         exit(EXIT_FAILURE);
     }
 
     return fuse_ret;
 }
 
-struct wfs_inode *find_inode_by_path(const char *path)
+static struct wfs_inode *inode_at(int num)
+{
+    // Slots are a block each unless mkfs packed them tighter
+    struct alloc_group *group = &groups[num / inodes_per_group];
+    return (struct wfs_inode *)(group->inodes + (off_t)(num % inodes_per_group) * inode_size);
+}
+
+// Returns the inode behind a FUSE inode number, or NULL if it is out of range or not allocated
+static struct wfs_inode *inode_from_ino(fuse_ino_t ino)
 {
-    printf("find node by path for %s\n", path);
-    if (strcmp(path, "/") == 0)
+    if (ino < WFS_INO(0) || ino >= WFS_INO(sb.num_inodes))
     {
-        return (struct wfs_inode *)((char *)mapped_memory + sb.i_blocks_ptr); // Return root inode directly
+        return NULL;
     }
+    int num = ino - WFS_INO(0);
+    return bitmap_test(&groups[num / inodes_per_group].inode_bits, num % inodes_per_group) ? inode_at(num) : NULL;
+}
 
-    struct wfs_inode *current_inode = (struct wfs_inode *)((char *)mapped_memory + sb.i_blocks_ptr);
-    char *path_copy = strdup(path);
-    if (!path_copy)
+// Like inode_from_ino, but returns the inode locked for reading or writing. Nothing is left
+// locked when it returns NULL.
+static struct wfs_inode *inode_lock(fuse_ino_t ino, bool write)
+{
+    if (ino < WFS_INO(0) || ino >= WFS_INO(sb.num_inodes))
     {
-        perror("strdup failed");
         return NULL;
     }
+    int num = ino - WFS_INO(0);
+    if (write)
+        pthread_rwlock_wrlock(&inode_locks[num]);
+    else
+        pthread_rwlock_rdlock(&inode_locks[num]);
+
+    // Only checked under the lock: the inode may have been freed while we waited
+    struct wfs_inode *inode = inode_from_ino(ino);
+    if (!inode)
+    {
+        pthread_rwlock_unlock(&inode_locks[num]);
+    }
+    return inode;
+}
+
+// Takes the number rather than the inode, whose slot may have been freed and reused meanwhile
+static void inode_unlock(int num)
+{
+    pthread_rwlock_unlock(&inode_locks[num]);
+}
+
+static unsigned long dcache_hash(int parent, const char *name)
+{
+    // FNV-1a over the name, seeded with the parent inode number
+    unsigned long hash = 14695981039346656037UL ^ (unsigned long)(parent + 1);
+    for (const char *c = name; *c; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
 
-    char *token = strtok(path_copy, "/");
-    while (token != NULL)
+static void dcache_flush(void)
+{
+    for (int i = 0; i < DCACHE_BUCKETS; i++)
     {
-        if (!S_ISDIR(current_inode->mode))
+        struct dcache_entry *entry = dcache[i];
+        while (entry)
         {
-            fprintf(stderr, "Not a directory\n");
-            free(path_copy);
-            return NULL;
+            struct dcache_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        dcache[i] = NULL;
+    }
+    dcache_count = 0;
+    dcache_generation++;
+
+    // Directories are no longer fully represented in the cache
+    for (size_t i = 0; i < sb.num_inodes; i++)
+    {
+        dir_states[i].complete = false;
+    }
+}
+
+// Returns the cached inode number for the key, or -1 on a miss
+static int dcache_lookup(int parent, const char *name)
+{
+    unsigned long hash = dcache_hash(parent, name);
+    int num = -1;
+    pthread_mutex_lock(&dcache_lock);
+    for (struct dcache_entry *entry = dcache[hash % DCACHE_BUCKETS]; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->parent == parent && strcmp(entry->name, name) == 0)
+        {
+            num = entry->num;
+            break;
         }
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return num;
+}
 
-        bool found = false;
-        // Check direct blocks
-        for (int i = 0; i < D_BLOCK; i++)
+// dcache_insert with dcache_lock held
+static void dcache_store(int parent, const char *name, int num)
+{
+    unsigned long hash = dcache_hash(parent, name);
+    struct dcache_entry **bucket = &dcache[hash % DCACHE_BUCKETS];
+    for (struct dcache_entry *entry = *bucket; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->parent == parent && strcmp(entry->name, name) == 0)
         {
-            if (current_inode->blocks[i] != 0)
-            {
-                struct wfs_dentry *dentries = (struct wfs_dentry *)((char *)mapped_memory + current_inode->blocks[i]);
-                for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
-                {
-                    if (strcmp(dentries[j].name, token) == 0)
-                    {
-                        current_inode = (struct wfs_inode *)((char *)mapped_memory + sb.i_blocks_ptr + dentries[j].num * BLOCK_SIZE);
-                        found = true;
-                        break;
-                    }
-                }
-            }
-            if (found)
-                break;
+            entry->num = num;
+            return;
+        }
+    }
+
+    if (dcache_count >= DCACHE_MAX_ENTRIES)
+    {
+        dcache_flush(); // Crude but bounded: start over rather than track recency
+        bucket = &dcache[hash % DCACHE_BUCKETS];
+    }
+
+    struct dcache_entry *entry = malloc(sizeof(struct dcache_entry) + strlen(name) + 1);
+    if (!entry)
+    {
+        return; // The cache is only an optimization
+    }
+    entry->hash = hash;
+    entry->parent = parent;
+    entry->num = num;
+    strcpy(entry->name, name);
+    entry->next = *bucket;
+    *bucket = entry;
+    dcache_count++;
+}
+
+static void dcache_insert(int parent, const char *name, int num)
+{
+    pthread_mutex_lock(&dcache_lock);
+    dcache_store(parent, name, num);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+static void dcache_remove(int parent, const char *name)
+{
+    unsigned long hash = dcache_hash(parent, name);
+    pthread_mutex_lock(&dcache_lock);
+    for (struct dcache_entry **link = &dcache[hash % DCACHE_BUCKETS]; *link; link = &(*link)->next)
+    {
+        struct dcache_entry *entry = *link;
+        if (entry->hash == hash && entry->parent == parent && strcmp(entry->name, name) == 0)
+        {
+            *link = entry->next;
+            free(entry);
+            dcache_count--;
+            break;
         }
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// Returns whether every live entry of directory num is in the dcache
+static bool dcache_complete(int num)
+{
+    pthread_mutex_lock(&dcache_lock);
+    bool complete = dir_states[num].complete;
+    pthread_mutex_unlock(&dcache_lock);
+    return complete;
+}
+
+// Returns the dentries stored in logical block b of a directory, or NULL if it is unallocated
+static struct wfs_dentry *dentry_block(struct wfs_inode *dir_inode, int b, enum image_access access)
+{
+    off_t block_ptr;
+    if (b < D_BLOCK)
+    {
+        block_ptr = dir_inode->blocks[b];
+    }
+    else
+    {
+        if (dir_inode->blocks[IND_BLOCK] == 0)
+            return NULL;
+        off_t *indirect_blocks = image_block(dir_inode->blocks[IND_BLOCK], IMAGE_READ);
+        block_ptr = indirect_blocks[b - D_BLOCK];
+    }
+    return block_ptr ? image_block(block_ptr, access) : NULL;
+}
 
-        // If not found in direct blocks, check indirect block
-        if (!found && current_inode->blocks[IND_BLOCK] != 0)
+// Single pass over a directory: returns the inode number of name or -1, and stores the
+// first free dentry slot in *free_slot (-1 if the directory is full). Live entries seen
+// along the way are cached; a pass that reads the whole directory marks it complete.
+static int scan_directory(struct wfs_inode *dir_inode, const char *name, int *free_slot)
+{
+    struct dir_state *state = &dir_states[dir_inode->num];
+    pthread_mutex_lock(&dcache_lock);
+    unsigned long generation = dcache_generation;
+    bool complete = state->complete;
+    pthread_mutex_unlock(&dcache_lock);
+    int first_free = -1;
+
+    for (int b = 0; b < DIR_MAX_BLOCKS; b++)
+    {
+        struct wfs_dentry *dentries = dentry_block(dir_inode, b, IMAGE_READ);
+        if (!dentries)
+        {
+            if (first_free == -1)
+                first_free = b * DENTRIES_PER_BLOCK;
+            if (b >= D_BLOCK)
+                break; // Indirect dentry blocks are allocated in order
+            continue;
+        }
+        for (int j = 0; j < DENTRIES_PER_BLOCK; j++)
         {
-            off_t *indirect_blocks = (off_t *)((char *)mapped_memory + current_inode->blocks[IND_BLOCK]);
-            for (int k = 0; k < BLOCK_SIZE / sizeof(off_t) && indirect_blocks[k] != 0; k++)
+            if (dentries[j].num == 0)
             {
-                struct wfs_dentry *dentries = (struct wfs_dentry *)((char *)mapped_memory + indirect_blocks[k]);
-                for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
-                {
-                    if (strcmp(dentries[j].name, token) == 0)
-                    {
-                        current_inode = (struct wfs_inode *)((char *)mapped_memory + sb.i_blocks_ptr + dentries[j].num * BLOCK_SIZE);
-                        found = true;
-                        break;
-                    }
-                }
-                if (found)
-                    break;
+                if (first_free == -1)
+                    first_free = b * DENTRIES_PER_BLOCK + j;
+                continue;
+            }
+            if (!complete)
+                dcache_insert(dir_inode->num, dentries[j].name, dentries[j].num);
+            if (strcmp(dentries[j].name, name) == 0)
+            {
+                if (free_slot)
+                    *free_slot = first_free;
+                return dentries[j].num;
             }
         }
+    }
+
+    // Lookups scan under a read lock, so only a caller about to add an entry moves the hint
+    if (free_slot && first_free != -1)
+        state->free_hint = first_free;
+    pthread_mutex_lock(&dcache_lock);
+    if (dcache_generation == generation)
+        state->complete = true;
+    pthread_mutex_unlock(&dcache_lock);
+    if (free_slot)
+        *free_slot = first_free;
+    return -1;
+}
+
+// Looks up name in a directory, scanning it only when the dcache cannot answer
+static int lookup_dentry(struct wfs_inode *dir_inode, const char *name)
+{
+    int num = dcache_lookup(dir_inode->num, name);
+    if (num >= 0)
+        return num;
+    if (dir_inode->flags & WFS_INODE_DIR_INDEX)
+    {
+        num = hashed_dir_lookup(dir_inode, name);
+        if (num != -1)
+            dcache_insert(dir_inode->num, name, num);
+        return num;
+    }
+    if (dcache_complete(dir_inode->num))
+        return -1;
+    return scan_directory(dir_inode, name, NULL);
+}
 
-        if (!found)
+// Finds the first free dentry slot at or after the directory's free hint
+static int find_free_slot(struct wfs_inode *dir_inode)
+{
+    for (int slot = dir_states[dir_inode->num].free_hint; slot < DIR_MAX_BLOCKS * DENTRIES_PER_BLOCK; slot++)
+    {
+        struct wfs_dentry *dentries = dentry_block(dir_inode, slot / DENTRIES_PER_BLOCK, IMAGE_READ);
+        if (!dentries || dentries[slot % DENTRIES_PER_BLOCK].num == 0)
         {
-            fprintf(stderr, "Path component %s not found\n", token);
-            free(path_copy);
-            return NULL;
+            dir_states[dir_inode->num].free_hint = slot;
+            return slot;
         }
+    }
+    return -1;
+}
 
-        token = strtok(NULL, "/");
+/*
+  Hashed directories (WFS_INODE_DIR_INDEX) keep their dentries in an open
+  addressing table of dentry blocks. The table doubles from one block and
+  its last step stops at DIR_MAX_BLOCKS, so it holds as many entries as a
+  linear directory. An entry lives at or after slot dentry_hash(name) %
+  capacity, probing linearly, and removal shifts later entries back so no
+  tombstones are needed. readdir walks the blocks like any other directory.
+  The inode size holds the number of live entries times
+  sizeof(struct wfs_dentry).
+*/
+static unsigned int dentry_hash(const char *name)
+{
+    // 32-bit FNV-1a; this is part of the on-disk format
+    unsigned int hash = 2166136261U;
+    for (const char *c = name; *c; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619U;
     }
+    return hash;
+}
 
-    free(path_copy);
-    return current_inode; // Return the inode found at the end of the path
+static int hashed_dir_blocks(struct wfs_inode *dir_inode)
+{
+    // Lookups may fill this in side by side under a read lock; they all store the same count
+    struct dir_state *state = &dir_states[dir_inode->num];
+    int blocks = __atomic_load_n(&state->hash_blocks, __ATOMIC_RELAXED);
+    if (blocks == 0)
+    {
+        while (blocks < DIR_MAX_BLOCKS && dentry_block(dir_inode, blocks, IMAGE_READ))
+            blocks++;
+        __atomic_store_n(&state->hash_blocks, blocks, __ATOMIC_RELAXED);
+    }
+    return blocks;
 }
 
-static int wfs_getattr(const char *path, struct stat *stbuf)
+static struct wfs_dentry *hashed_dir_slot(struct wfs_inode *dir_inode, int slot, enum image_access access)
 {
-    // Clear out the stat buffer
-    printf("get attribute of%s\n", path);
-    memset(stbuf, 0, sizeof(struct stat));
-    // Find the inode for the given path
-    struct wfs_inode *inode = find_inode_by_path(path);
-    if (!inode)
+    return dentry_block(dir_inode, slot / DENTRIES_PER_BLOCK, access) + slot % DENTRIES_PER_BLOCK;
+}
+
+// Returns the slot holding name, or the empty slot where it would go if absent
+static int hashed_dir_probe(struct wfs_inode *dir_inode, const char *name, int capacity)
+{
+    int slot = dentry_hash(name) % capacity;
+    for (int probes = 0; probes < capacity; probes++)
     {
-        // If the inode was not found, return an error
-        return -ENOENT;
+        struct wfs_dentry *dentry = hashed_dir_slot(dir_inode, slot, IMAGE_READ);
+        if (dentry->num == 0 || strcmp(dentry->name, name) == 0)
+            return slot;
+        slot = (slot + 1) % capacity;
     }
+    return -1; // Table is full and name is not in it
+}
 
-    // Set the appropriate fields in stbuf from the inode
-    stbuf->st_mode = inode->mode;
-    stbuf->st_nlink = inode->nlinks;
-    stbuf->st_size = inode->size;
-    stbuf->st_uid = inode->uid;
-    stbuf->st_gid = inode->gid;
-    stbuf->st_atime = inode->atim;
-    stbuf->st_mtime = inode->mtim;
-    stbuf->st_ctime = inode->ctim;
+static int hashed_dir_lookup(struct wfs_inode *dir_inode, const char *name)
+{
+    int capacity = hashed_dir_blocks(dir_inode) * DENTRIES_PER_BLOCK;
+    if (capacity == 0)
+        return -1;
+    int slot = hashed_dir_probe(dir_inode, name, capacity);
+    if (slot == -1)
+        return -1;
+    struct wfs_dentry *dentry = hashed_dir_slot(dir_inode, slot, IMAGE_READ);
+    return dentry->num != 0 ? dentry->num : -1;
+}
+
+// Doubles the table and rehashes every entry into it
+static int hashed_dir_grow(struct wfs_inode *dir_inode)
+{
+    int old_blocks = hashed_dir_blocks(dir_inode);
+    if (old_blocks == DIR_MAX_BLOCKS)
+        return -ENOSPC;
+    int new_blocks = old_blocks ? min(old_blocks * 2, DIR_MAX_BLOCKS) : 1;
+
+    size_t count = dir_inode->size / sizeof(struct wfs_dentry);
+    struct wfs_dentry *saved = malloc((count ? count : 1) * sizeof(struct wfs_dentry));
+    if (!saved)
+        return -ENOMEM;
+
+    bool had_indirect = dir_inode->blocks[IND_BLOCK] != 0;
+    for (int b = old_blocks; b < new_blocks; b++)
+    {
+        if (!dir_block_alloc(dir_inode, b))
+        {
+            // The table size is derived from the allocated blocks, so give back the partial growth
+            for (int undo = old_blocks; undo < b; undo++)
+            {
+                off_t *block_ptr = undo < D_BLOCK ? &dir_inode->blocks[undo]
+                                                  : (off_t *)image_block(dir_inode->blocks[IND_BLOCK], IMAGE_WRITE) + (undo - D_BLOCK);
+                count_blocks(dir_inode, -1);
+                free_block(*block_ptr);
+                *block_ptr = 0;
+            }
+            // Along with the indirect block, if this growth was the first to need it
+            if (!had_indirect && dir_inode->blocks[IND_BLOCK] != 0)
+            {
+                free_block(dir_inode->blocks[IND_BLOCK]);
+                dir_inode->blocks[IND_BLOCK] = 0;
+            }
+            free(saved);
+            return -ENOSPC;
+        }
+    }
 
-    // Set the number of 512-byte blocks used by this inode
-    stbuf->st_blocks = inode->size / 512 + (inode->size % 512 ? 1 : 0);
+    size_t n = 0;
+    for (int b = 0; b < old_blocks; b++)
+    {
+        struct wfs_dentry *dentries = dentry_block(dir_inode, b, IMAGE_WRITE);
+        for (int j = 0; j < DENTRIES_PER_BLOCK; j++)
+        {
+            if (dentries[j].num != 0 && n < count)
+                saved[n++] = dentries[j];
+        }
+        memset(dentries, 0, block_size);
+    }
 
-    printf("num:%dmode: %o, size: %ld\n", inode->num, inode->mode, inode->size);
+    int capacity = new_blocks * DENTRIES_PER_BLOCK;
+    dir_states[dir_inode->num].hash_blocks = new_blocks;
+    for (size_t i = 0; i < n; i++)
+    {
+        *hashed_dir_slot(dir_inode, hashed_dir_probe(dir_inode, saved[i].name, capacity), IMAGE_WRITE) = saved[i];
+    }
+    free(saved);
     return 0;
 }
 
-static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+static int hashed_dir_insert(struct wfs_inode *dir_inode, int new_inode_num, const char *name)
 {
-    printf("readdir...\n");
-    struct wfs_inode *inode = find_inode_by_path(path);
-    if (!inode || !S_ISDIR(inode->mode))
+    size_t count = dir_inode->size / sizeof(struct wfs_dentry);
+    int capacity = hashed_dir_blocks(dir_inode) * DENTRIES_PER_BLOCK;
+
+    // Keep the load factor at or below 3/4 while the table can still grow
+    if ((count + 1) * 4 > (size_t)capacity * 3)
     {
-        return -ENOENT; // Inode not found or not a directory
+        int ret = hashed_dir_grow(dir_inode);
+        if (ret != 0 && count >= (size_t)capacity)
+            return ret;
+        capacity = hashed_dir_blocks(dir_inode) * DENTRIES_PER_BLOCK;
     }
 
-    // Read from direct blocks first
-    for (int i = 0; i < D_BLOCK && inode->blocks[i] != 0; i++)
+    int slot = hashed_dir_probe(dir_inode, name, capacity);
+    if (slot == -1)
+        return -ENOSPC;
+    struct wfs_dentry *dentry = hashed_dir_slot(dir_inode, slot, IMAGE_WRITE);
+    strncpy(dentry->name, name, MAX_NAME - 1);
+    dentry->name[MAX_NAME - 1] = '\0';
+    dentry->num = new_inode_num;
+    dir_inode->size += sizeof(struct wfs_dentry);
+    return 0;
+}
+
+static int hashed_dir_remove(struct wfs_inode *dir_inode, int inode_num, const char *name)
+{
+    int capacity = hashed_dir_blocks(dir_inode) * DENTRIES_PER_BLOCK;
+    if (capacity == 0)
+        return -ENOENT;
+    int hole = hashed_dir_probe(dir_inode, name, capacity);
+    if (hole == -1 || hashed_dir_slot(dir_inode, hole, IMAGE_READ)->num != inode_num)
+        return -ENOENT;
+
+    // Shift back any entry in the probe run that would otherwise become unreachable; a full table
+    // has no empty slot to end the run, so stop on coming back around to the hole
+    int next = hole;
+    for (int probes = 1; probes < capacity; probes++)
     {
-        struct wfs_dentry *dentries = (struct wfs_dentry *)((char *)mapped_memory + inode->blocks[i]);
-        for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
+        next = (next + 1) % capacity;
+        struct wfs_dentry *dentry = hashed_dir_slot(dir_inode, next, IMAGE_READ);
+        if (dentry->num == 0)
+            break;
+        int home = dentry_hash(dentry->name) % capacity;
+        bool reachable = hole <= next ? (home > hole && home <= next) : (home > hole || home <= next);
+        if (!reachable)
         {
-            if (dentries[j].num != 0) // Valid entry
-            {
-                if (filler(buf, dentries[j].name, NULL, 0) != 0)
-                    return 0; // Buffer full or other filler-related error
-            }
+            *hashed_dir_slot(dir_inode, hole, IMAGE_WRITE) = *dentry;
+            hole = next;
         }
     }
-
-    // Handle indirect block
-    if (inode->blocks[IND_BLOCK] != 0)
+
+    struct wfs_dentry *dentry = hashed_dir_slot(dir_inode, hole, IMAGE_WRITE);
+    dentry->num = 0;
+    memset(dentry->name, 0, MAX_NAME);
+    dir_inode->size -= sizeof(struct wfs_dentry);
+    return 0;
+}
+
+// Checks that name can be created in parent_inode, reading the directory at most once.
+// On success *slot is where the new dentry should go.
+static int check_new_entry(struct wfs_inode *parent_inode, const char *name, int *slot)
+{
+    if (strlen(name) >= MAX_NAME)
+    {
+        return -ENAMETOOLONG;
+    }
+    if (!S_ISDIR(parent_inode->mode))
+    {
+        return -ENOTDIR; // Parent is not a directory
+    }
+
+    int num = dcache_lookup(parent_inode->num, name);
+    if (num >= 0)
+    {
+        return -EEXIST;
+    }
+    if (parent_inode->flags & WFS_INODE_DIR_INDEX)
+    {
+        // The slot is chosen by hash when the entry is inserted
+        *slot = -1;
+        return hashed_dir_lookup(parent_inode, name) != -1 ? -EEXIST : 0;
+    }
+    if (dcache_complete(parent_inode->num))
+    {
+        *slot = find_free_slot(parent_inode);
+    }
+    else if (scan_directory(parent_inode, name, slot) != -1)
+    {
+        return -EEXIST;
+    }
+    return *slot == -1 ? -ENOSPC : 0;
+}
+
+static void fill_stat(struct wfs_inode *inode, struct stat *stbuf)
+{
+    // Clear out the stat buffer
+    memset(stbuf, 0, sizeof(struct stat));
+
+    // Set the appropriate fields in stbuf from the inode
+    stbuf->st_ino = WFS_INO(inode->num);
+    stbuf->st_mode = inode->mode;
+    stbuf->st_nlink = inode->nlinks;
+    stbuf->st_size = inode->size;
+    stbuf->st_uid = inode->uid;
+    stbuf->st_gid = inode->gid;
+    stbuf->st_atime = inode->atim;
+    stbuf->st_mtime = inode->mtim;
+    stbuf->st_ctime = inode->ctim;
+
+    stbuf->st_blksize = block_size;
+
+    // Set the number of 512-byte units allocated to this inode; less than the size for sparse files.
+    // Inodes last changed by an older wfs have no count, so their blocks are counted from the map.
+    off_t blocks = (inode->flags & WFS_INODE_BLOCK_COUNT) ? inode->nblocks : inode_data_blocks(inode);
+    stbuf->st_blocks = blocks * (block_size / 512);
+}
+
+static void wfs_conn_init(void *userdata, struct fuse_conn_info *conn)
+{
+    // Reads reply with buffers in the mapped image, which the kernel can then splice rather than
+    // copy, and writes arrive in a pipe that write_buf reads straight into the blocks
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_READ);
+}
+
+static void wfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct wfs_inode *parent_inode = inode_lock(parent, false);
+    if (!parent_inode)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (!S_ISDIR(parent_inode->mode))
+    {
+        inode_unlock(parent_inode->num);
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.attr_timeout = WFS_TIMEOUT;
+    e.entry_timeout = WFS_TIMEOUT;
+
+    int num = lookup_dentry(parent_inode, name);
+    if (num != -1)
+    {
+        e.ino = WFS_INO(num);
+        pthread_rwlock_rdlock(&inode_locks[num]);
+        e.generation = inode_generations[num];
+        fill_stat(inode_at(num), &e.attr);
+        if (S_ISDIR(e.attr.st_mode))
+        {
+            // There is no parent pointer on disk; the kernel reaches every directory other than the
+            // root through a lookup or mkdir in its parent, so that is where ".." is learned
+            __atomic_store_n(&dir_states[num].parent, parent_inode->num, __ATOMIC_RELAXED);
+        }
+        inode_unlock(num);
+    }
+    inode_unlock(parent_inode->num);
+    // An entry with inode number 0 lets the kernel cache the miss as a negative dentry
+    fuse_reply_entry(req, &e);
+}
+
+static void wfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    // Inodes live in the image and are freed on unlink, so there is no lookup count to drop; a number
+    // the kernel still holds when it is reused comes back with a new generation instead
+    fuse_reply_none(req);
+}
+
+static void wfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct wfs_inode *inode = inode_lock(ino, false);
+    if (!inode)
+    {
+        // If the inode was not found, return an error
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    struct stat stbuf;
+    fill_stat(inode, &stbuf);
+    inode_unlock(inode->num);
+    fuse_reply_attr(req, &stbuf, WFS_TIMEOUT);
+}
+
+static void wfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    // Straight from the running counts: df never scans a bitmap
+    struct statvfs st = {0};
+    st.f_bsize = block_size;
+    st.f_frsize = block_size;
+    st.f_blocks = sb.num_data_blocks;
+    st.f_files = sb.num_inodes;
+    st.f_bfree = __atomic_load_n(&sb.free_blocks, __ATOMIC_RELAXED);
+    st.f_ffree = __atomic_load_n(&sb.free_inodes, __ATOMIC_RELAXED);
+    st.f_bavail = st.f_bfree;
+    st.f_favail = st.f_ffree;
+    st.f_namemax = MAX_NAME - 1;
+    fuse_reply_statfs(req, &st);
+}
+
+// Appends one entry to a readdir reply, returning false once the buffer is full
+static bool readdir_add(fuse_req_t req, char *buf, size_t size, size_t *used, const char *name, int num, mode_t mode, off_t next_offset)
+{
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.st_ino = WFS_INO(num);
+    stbuf.st_mode = mode;
+
+    size_t entry_size = fuse_add_direntry(req, buf + *used, size - *used, name, &stbuf, next_offset);
+    if (entry_size > size - *used)
+    {
+        return false;
+    }
+    *used += entry_size;
+    return true;
+}
+
+static void wfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    char *buf = malloc(size);
+    if (!buf)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    struct wfs_inode *inode = inode_lock(ino, false);
+    if (!inode || !S_ISDIR(inode->mode))
+    {
+        if (inode)
+            inode_unlock(inode->num);
+        fuse_reply_err(req, inode ? ENOTDIR : ENOENT);
+        free(buf);
+        return;
+    }
+
+    // Offsets 1 and 2 follow "." and ".."; the dentry in slot s is followed by offset s + 3.
+    // The root's parent is itself, and dir_states zeroes its parent to say so.
+    size_t used = 0;
+    bool full = false;
+    if (offset < 1)
+    {
+        full = !readdir_add(req, buf, size, &used, ".", inode->num, inode->mode, 1);
+    }
+    if (!full && offset < 2)
+    {
+        int parent = __atomic_load_n(&dir_states[inode->num].parent, __ATOMIC_RELAXED);
+        full = !readdir_add(req, buf, size, &used, "..", parent, S_IFDIR, 2);
+    }
+    for (int slot = offset < 2 ? 0 : offset - 2; !full && slot < DIR_MAX_BLOCKS * DENTRIES_PER_BLOCK; slot++)
+    {
+        struct wfs_dentry *dentries = dentry_block(inode, slot / DENTRIES_PER_BLOCK, IMAGE_READ);
+        if (!dentries)
+        {
+            slot += DENTRIES_PER_BLOCK - 1 - slot % DENTRIES_PER_BLOCK; // Skip the unallocated block
+            continue;
+        }
+        struct wfs_dentry *dentry = &dentries[slot % DENTRIES_PER_BLOCK];
+        if (dentry->num != 0) // Valid entry
+        {
+            // The directory is locked, so the entry cannot go away while its mode is read
+            pthread_rwlock_rdlock(&inode_locks[dentry->num]);
+            mode_t mode = inode_at(dentry->num)->mode;
+            inode_unlock(dentry->num);
+            full = !readdir_add(req, buf, size, &used, dentry->name, dentry->num, mode, slot + 3);
+        }
+    }
+    inode_unlock(inode->num);
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+// Returns the index of the first run that ends after lblock: the run holding it, or the next one
+static int map_find(struct open_file *of, uint32_t lblock)
+{
+    // Sequential I/O keeps landing on the same run or the one after it. Readers share the file's
+    // lock, so the cursor is only a hint that any of them may move.
+    int cursor = __atomic_load_n(&of->cursor, __ATOMIC_RELAXED);
+    for (int i = cursor; i < of->map_len && i <= cursor + 1; i++)
+    {
+        if (lblock < of->map[i].lblock + of->map[i].len &&
+            (i == 0 || lblock >= of->map[i - 1].lblock + of->map[i - 1].len))
+        {
+            __atomic_store_n(&of->cursor, i, __ATOMIC_RELAXED);
+            return i;
+        }
+    }
+
+    int lo = 0;
+    int hi = of->map_len;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (of->map[mid].lblock + of->map[mid].len <= lblock)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < of->map_len)
+    {
+        __atomic_store_n(&of->cursor, lo, __ATOMIC_RELAXED);
+    }
+    return lo;
+}
+
+static int map_grow(struct open_file *of)
+{
+    int cap = of->map_cap ? of->map_cap * 2 : 8;
+    struct wfs_extent *map = realloc(of->map, cap * sizeof(struct wfs_extent));
+    if (!map)
+    {
+        return -ENOMEM;
+    }
+    of->map = map;
+    of->map_cap = cap;
+    return 0;
+}
+
+// Adds a run after every existing one, merging it into the last run if it continues it
+static int map_append(struct open_file *of, uint32_t lblock, off_t start, uint32_t len)
+{
+    struct wfs_extent *last = of->map_len ? &of->map[of->map_len - 1] : NULL;
+    if (last && last->lblock + last->len == lblock && last->start + (off_t)last->len * block_size == start)
+    {
+        last->len += len;
+        return 0;
+    }
+    if (of->map_len == of->map_cap && map_grow(of) != 0)
+    {
+        return -ENOMEM;
+    }
+    of->map[of->map_len++] = (struct wfs_extent){.lblock = lblock, .len = len, .start = start};
+    return 0;
+}
+
+// Records a newly mapped block, merging it with the runs around it. The caller makes sure the map
+// has room for one more run. Returns the index of the run that now holds lblock.
+static int map_add(struct open_file *of, uint32_t lblock, off_t start)
+{
+    count_blocks(inode_at(of->num), 1);
+    int i = map_find(of, lblock);
+    struct wfs_extent *prev = i > 0 ? &of->map[i - 1] : NULL;
+    struct wfs_extent *next = i < of->map_len ? &of->map[i] : NULL;
+    bool joins_prev = prev && prev->lblock + prev->len == lblock && prev->start + (off_t)prev->len * block_size == start;
+    bool joins_next = next && lblock + 1 == next->lblock && start + block_size == next->start;
+
+    if (joins_prev && joins_next)
+    {
+        prev->len += 1 + next->len;
+        memmove(next, next + 1, (of->map_len - i - 1) * sizeof(struct wfs_extent));
+        of->map_len--;
+        i--;
+    }
+    else if (joins_prev)
+    {
+        prev->len++;
+        i--;
+    }
+    else if (joins_next)
+    {
+        next->lblock--;
+        next->start -= block_size;
+        next->len++;
+    }
+    else
+    {
+        memmove(&of->map[i + 1], &of->map[i], (of->map_len - i) * sizeof(struct wfs_extent));
+        of->map[i] = (struct wfs_extent){.lblock = lblock, .len = 1, .start = start};
+        of->map_len++;
+    }
+    return of->cursor = i;
+}
+
+// Inline data fills the rest of the inode's slot. Bytes past the file size there are kept zero.
+#define INLINE_MAX ((off_t)(inode_size - sizeof(struct wfs_inode)))
+
+static char *inline_data(struct wfs_inode *inode)
+{
+    return (char *)(inode + 1);
+}
+
+// Drops blocks [from, to) from the map. The caller makes sure the map has room for one more run,
+// in case a run has to be split in two.
+static void map_remove(struct open_file *of, uint32_t from, uint32_t to)
+{
+    long removed = 0;
+    for (int j = map_find(of, from); j < of->map_len && of->map[j].lblock < to; j++)
+    {
+        removed += min(of->map[j].lblock + of->map[j].len, to) - max(of->map[j].lblock, from);
+    }
+    count_blocks(inode_at(of->num), -removed);
+
+    int i = map_find(of, from);
+    while (i < of->map_len && of->map[i].lblock < to)
+    {
+        struct wfs_extent *run = &of->map[i];
+        uint32_t end = run->lblock + run->len;
+        if (run->lblock < from && end > to)
+        {
+            memmove(&of->map[i + 2], &of->map[i + 1], (of->map_len - i - 1) * sizeof(struct wfs_extent));
+            of->map[i + 1] = (struct wfs_extent){.lblock = to, .len = end - to, .start = run->start + (off_t)(to - run->lblock) * block_size};
+            of->map_len++;
+            run->len = from - run->lblock;
+            break;
+        }
+        if (run->lblock < from)
+        {
+            run->len = from - run->lblock;
+            i++;
+        }
+        else if (end > to)
+        {
+            run->start += (off_t)(to - run->lblock) * block_size;
+            run->len = end - to;
+            run->lblock = to;
+            break;
+        }
+        else
+        {
+            memmove(run, run + 1, (of->map_len - i - 1) * sizeof(struct wfs_extent));
+            of->map_len--;
+        }
+    }
+    of->cursor = 0;
+}
+
+// What holes in a file read from; a longer hole takes several buffers
+static const char hole_zeros[128 * 1024];
+
+// Appends a buffer of len bytes at mem to *bufv, which holds room for *cap. Returns 0 or -ENOMEM.
+static int bufvec_add(struct fuse_bufvec **bufv, size_t *cap, const void *mem, size_t len)
+{
+    if ((*bufv)->count == *cap)
+    {
+        struct fuse_bufvec *grown = realloc(*bufv, sizeof(struct fuse_bufvec) + (*cap * 2 - 1) * sizeof(struct fuse_buf));
+        if (!grown)
+        {
+            return -ENOMEM;
+        }
+        *bufv = grown;
+        *cap *= 2;
+    }
+    (*bufv)->buf[(*bufv)->count++] = (struct fuse_buf){.size = len, .mem = (void *)mem, .fd = -1};
+    return 0;
+}
+
+// Describes up to size bytes at offset of an open file as buffers pointing straight into the
+// mapped image, one for each run of blocks contiguous on disk, so that replying copies the data
+// once at most. The buffers stay valid while the file is locked. Returns the vector, which the
+// caller frees, or NULL when out of memory.
+static struct fuse_bufvec *read_inode(struct open_file *of, size_t size, off_t offset)
+{
+    size_t cap = 8;
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + (cap - 1) * sizeof(struct fuse_buf));
+    if (!bufv)
+    {
+        return NULL;
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = 0;
+
+    struct wfs_inode *inode = inode_at(of->num);
+    if (offset >= inode->size)
+    {
+        return bufv; // Nothing to read, offset is beyond the end of the file
+    }
+    size_t bytes_to_read = min(size, inode->size - offset);
+    if (inode->flags & WFS_INODE_INLINE_DATA)
+    {
+        bufvec_add(&bufv, &cap, inline_data(inode) + offset, bytes_to_read); // The first buffer always fits
+        return bufv;
+    }
+    size_t bytes_read = 0;
+    while (bytes_read < bytes_to_read)
+    {
+        off_t pos = offset + bytes_read;
+        uint32_t lblock = pos / block_size;
+        size_t chunk = bytes_to_read - bytes_read;
+        const char *mem;
+        int i = map_find(of, lblock);
+        if (i < of->map_len && of->map[i].lblock <= lblock)
+        {
+            // The run is contiguous on disk, so one buffer covers as much of it as is wanted, or
+            // of its block when cached
+            struct wfs_extent *run = &of->map[i];
+            off_t run_offset = pos - (off_t)run->lblock * block_size;
+            chunk = min(chunk, (off_t)run->len * block_size - run_offset);
+            mem = image_data(run->start, run_offset, &chunk, IMAGE_READ);
+        }
+        else
+        {
+            // Never written: zeros up to the next run
+            if (i < of->map_len)
+            {
+                chunk = min(chunk, (off_t)of->map[i].lblock * block_size - pos);
+            }
+            chunk = min(chunk, sizeof(hole_zeros));
+            mem = hole_zeros;
+        }
+        if (bufvec_add(&bufv, &cap, mem, chunk) != 0)
+        {
+            free(bufv);
+            return NULL;
+        }
+        bytes_read += chunk;
+    }
+    return bufv;
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+// Returns where the next data (SEEK_DATA) or hole (SEEK_HOLE) at or after off begins, or a negative
+// errno. The end of the file counts as a hole.
+static off_t seek_data_hole(struct open_file *of, off_t off, int whence)
+{
+    struct wfs_inode *inode = inode_at(of->num);
+    if (off < 0 || off >= inode->size)
+    {
+        return -ENXIO;
+    }
+    if (inode->flags & WFS_INODE_INLINE_DATA)
+    {
+        return whence == SEEK_DATA ? off : inode->size;
+    }
+
+    uint32_t lblock = off / block_size;
+    int i = map_find(of, lblock);
+    bool mapped = i < of->map_len && of->map[i].lblock <= lblock;
+    if (whence == SEEK_DATA)
+    {
+        if (mapped)
+            return off;
+        if (i == of->map_len || (off_t)of->map[i].lblock * block_size >= inode->size)
+            return -ENXIO; // Nothing but hole up to the end of the file
+        return (off_t)of->map[i].lblock * block_size;
+    }
+
+    if (!mapped)
+    {
+        return off;
+    }
+    // Runs split where the blocks are not contiguous on disk, so skip every run that follows on logically
+    off_t end = of->map[i].lblock + of->map[i].len;
+    while (i + 1 < of->map_len && of->map[i + 1].lblock == end)
+    {
+        i++;
+        end += of->map[i].len;
+    }
+    return min(end * block_size, inode->size);
+}
+
+static void wfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi)
+{
+    // The kernel handles the other whence values itself
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+    {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    struct open_file *of = (struct open_file *)(uintptr_t)fi->fh;
+    pthread_rwlock_rdlock(&inode_locks[of->num]);
+    off_t ret = seek_data_hole(of, off, whence);
+    inode_unlock(of->num);
+    if (ret < 0)
+    {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_lseek(req, ret);
+}
+#endif
+
+static void wfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct open_file *of = (struct open_file *)(uintptr_t)fi->fh;
+
+    // Reads of one file run side by side. The lock is held through the reply, which reads the
+    // blocks themselves, so that no write or truncate can change them underneath it.
+    pthread_rwlock_rdlock(&inode_locks[of->num]);
+    struct fuse_bufvec *bufv = read_inode(of, size, offset);
+    if (bufv)
+    {
+        fuse_reply_data(req, bufv, 0);
+    }
+    else
+    {
+        fuse_reply_err(req, ENOMEM);
+    }
+    inode_unlock(of->num);
+    free(bufv);
+}
+
+// Adds inodes and blocks, negative for an allocation, to the free counts of the superblock and of
+// group g, on disk too when the image keeps them. Every allocation and free calls it.
+static void update_counts(size_t g, long inodes, long blocks)
+{
+    __atomic_add_fetch(&sb.free_inodes, inodes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sb.free_blocks, blocks, __ATOMIC_RELAXED);
+    if (disk_sb)
+    {
+        __atomic_add_fetch(&disk_sb->free_inodes, inodes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&disk_sb->free_blocks, blocks, __ATOMIC_RELAXED);
+    }
+    if (disk_gdt)
+    {
+        __atomic_add_fetch(&disk_gdt[g].free_inodes, inodes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&disk_gdt[g].free_blocks, blocks, __ATOMIC_RELAXED);
+    }
+}
+
+// Raises *mark to at least value, returning what it was before
+static size_t raise_mark(size_t *mark, size_t value)
+{
+    size_t old = __atomic_load_n(mark, __ATOMIC_RELAXED);
+    while (old < value && !__atomic_compare_exchange_n(mark, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    return old;
+}
+
+// Writes group g's never-used mark through to the image, when the image keeps one. The mark on
+// disk only ever rises, so a thread saving a mark that another has since raised cannot lower it.
+static void save_fresh(size_t g)
+{
+    size_t mark = __atomic_load_n(&groups[g].fresh_from, __ATOMIC_RELAXED);
+    if (disk_gdt)
+    {
+        raise_mark(&disk_gdt[g].fresh_from, mark);
+    }
+    else if (disk_fresh)
+    {
+        raise_mark(&disk_sb->fresh_from, mark);
+    }
+}
+
+// Returns the byte offset of data block index i
+static off_t block_offset(size_t i)
+{
+    return groups[i / blocks_per_group].d_blocks_ptr + (off_t)(i % blocks_per_group) * block_size;
+}
+
+// Returns the data block index of the block at byte offset block_ptr, or -1 if there is none
+static long block_index(off_t block_ptr)
+{
+    // Groups lie in order through the image, so the last one whose data starts at or before
+    // block_ptr is the only one that can hold it
+    size_t lo = 0, hi = num_groups;
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (groups[mid].d_blocks_ptr <= block_ptr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (block_ptr < groups[lo].d_blocks_ptr)
+    {
+        return -1;
+    }
+    size_t k = (block_ptr - groups[lo].d_blocks_ptr) / block_size;
+    return k < groups[lo].data_bits.nbits ? (long)(lo * blocks_per_group + k) : -1;
+}
+
+// Notes that the n allocated blocks from block_ptr are about to be written, returning how many of
+// them, from the first, may hold old data; the rest still read as zero. Runs never cross a group.
+static size_t claim_blocks(off_t block_ptr, size_t n)
+{
+    long i = block_index(block_ptr);
+    size_t g = i / blocks_per_group;
+    size_t k = i % blocks_per_group;
+    size_t fresh = raise_mark(&groups[g].fresh_from, k + n); // Anything skipped over is given up as possibly dirty
+    if (k + n > fresh)
+    {
+        save_fresh(g);
+    }
+    return fresh > k ? min(n, fresh - k) : 0;
+}
+
+// Zeroes n bytes at offset into the run of data blocks from block_ptr
+static void zero_data(off_t block_ptr, off_t offset, size_t n)
+{
+    while (n > 0)
+    {
+        size_t len = n;
+        char *mem = image_data(block_ptr, offset, &len, IMAGE_OVERWRITE);
+        memset(mem, 0, len);
+        offset += len;
+        n -= len;
+    }
+}
+
+// Zeroes the n allocated blocks from block_ptr, skipping those that have never been used
+static void zero_blocks(off_t block_ptr, size_t n)
+{
+    size_t dirty = claim_blocks(block_ptr, n);
+    zero_data(block_ptr, 0, dirty * block_size);
+}
+
+// Returns the group of inode num, where its data should go
+static size_t inode_group(int num)
+{
+    return num / inodes_per_group;
+}
+
+// Returns the calling thread's cursors, one per group, or NULL to fall back on the shared ones
+static struct alloc_cursor *thread_cursors(void)
+{
+    struct alloc_cursor *cursors = pthread_getspecific(cursor_key);
+    if (cursors)
+    {
+        return cursors;
+    }
+    cursors = malloc(num_groups * sizeof(struct alloc_cursor));
+    if (!cursors || pthread_setspecific(cursor_key, cursors) != 0)
+    {
+        free(cursors);
+        return NULL;
+    }
+
+    // Reversing the bits of n gives the fraction in the order 0, 1/2, 1/4, 3/4, ...
+    size_t n = __atomic_fetch_add(&cursor_threads, 1, __ATOMIC_RELAXED);
+    double fraction = 0;
+    for (double bit = 0.5; n > 0; n >>= 1, bit /= 2)
+    {
+        fraction += (n & 1) * bit;
+    }
+    for (size_t g = 0; g < num_groups; g++)
+    {
+        cursors[g].inode = groups[g].inode_bits.nbits * fraction;
+        cursors[g].data = groups[g].data_bits.nbits * fraction;
+    }
+    return cursors;
+}
+
+// Returns the calling thread's data cursor for group g, or NULL
+static size_t *data_cursor(size_t g)
+{
+    struct alloc_cursor *cursors = thread_cursors();
+    return cursors ? &cursors[g].data : NULL;
+}
+
+// Marks the n blocks from block_ptr, already taken in memory, as used on disk. Runs never cross a group.
+static void use_blocks(off_t block_ptr, size_t n)
+{
+    long i = block_index(block_ptr);
+    size_t g = i / blocks_per_group;
+    update_counts(g, 0, -(long)bitmap_alloc_at(&groups[g].data_bits, i % blocks_per_group, n));
+}
+
+// Allocates a block, searching from the thread's cursor in the given group on through the groups
+// after it
+off_t allocate_block(size_t group)
+{
+    off_t block_ptr = -1;
+    for (size_t k = 0; k < num_groups; k++)
+    {
+        size_t g = (group + k) % num_groups;
+        long i = bitmap_alloc(&groups[g].avail_bits, data_cursor(g));
+        if (i == -1)
+        {
+            continue; // The group is full
+        }
+        block_ptr = block_offset(g * blocks_per_group + i);
+        use_blocks(block_ptr, 1);
+        break;
+    }
+
+    // Hand out zeroed blocks so callers can rely on empty dentries and null pointers
+    if (block_ptr != -1)
+    {
+        zero_blocks(block_ptr, 1);
+    }
+    return block_ptr;
+}
+
+// Like allocate_block, but takes the first free block at or after block index goal, preferring
+// the goal's group
+static off_t allocate_block_near(size_t goal)
+{
+    goal = goal < sb.num_data_blocks ? goal : 0;
+    off_t block_ptr = -1;
+    for (size_t k = 0; k < num_groups; k++)
+    {
+        size_t g = (goal / blocks_per_group + k) % num_groups;
+        long i = bitmap_alloc_near(&groups[g].avail_bits, k == 0 ? goal % blocks_per_group : 0);
+        if (i != -1)
+        {
+            block_ptr = block_offset(g * blocks_per_group + i);
+            use_blocks(block_ptr, 1);
+            break;
+        }
+    }
+    if (block_ptr != -1)
+    {
+        zero_blocks(block_ptr, 1);
+    }
+    return block_ptr;
+}
+
+// Takes up to n contiguous blocks, preferring the given group, returning the byte offset of the
+// first and the count in *count, or -1 when the disk is full. Shorter runs are taken when no group
+// has a run of n free. Unlike allocate_block, the blocks are only set aside in memory: callers mark
+// the ones they use with use_blocks, claim them and clear whatever they will not overwrite.
+static off_t allocate_blocks(size_t group, size_t n, size_t *count)
+{
+    off_t block_ptr = -1;
+    for (size_t want = n; want > 0 && block_ptr == -1; want /= 2)
+    {
+        for (size_t k = 0; k < num_groups; k++)
+        {
+            size_t g = (group + k) % num_groups;
+            long i = bitmap_alloc_run(&groups[g].avail_bits, want, data_cursor(g));
+            if (i != -1)
+            {
+                *count = want;
+                block_ptr = block_offset(g * blocks_per_group + i);
+                break;
+            }
+        }
+    }
+    return block_ptr;
+}
+
+// Allocates an inode in its parent's group. A new directory instead goes to the group with the
+// most free data blocks, so that directories spread out and each keeps its files close by.
+// The inode comes back locked for writing, so nothing holding its number from a previous life
+// can see it until the caller has set it up.
+int allocate_inode(struct wfs_inode *parent_inode, bool is_dir)
+{
+    size_t start = inode_group(parent_inode->num);
+    if (is_dir)
+    {
+        for (size_t g = 0; g < num_groups; g++)
+        {
+            struct alloc_group *group = &groups[g];
+            if (bitmap_nfree(&group->inode_bits) > 0 && bitmap_nfree(&group->data_bits) > bitmap_nfree(&groups[start].data_bits))
+                start = g;
+        }
+    }
+
+    struct alloc_cursor *cursors = thread_cursors();
+    long i = -1;
+    size_t g = start;
+    for (size_t k = 0; k < num_groups && i == -1; k++)
+    {
+        g = (start + k) % num_groups;
+        i = bitmap_alloc(&groups[g].inode_bits, cursors ? &cursors[g].inode : NULL); // Inode 0 is the root and always allocated
+    }
+    if (i != -1)
+    {
+        update_counts(g, -1, 0);
+    }
+    if (i == -1)
+    {
+        return -1; // No free inodes available
+    }
+    i += g * inodes_per_group;
+
+    pthread_rwlock_wrlock(&inode_locks[i]);
+    struct wfs_inode *new_inode = inode_at(i);
+    memset(new_inode, 0, sizeof(struct wfs_inode)); // Zero out the new inode
+    new_inode->num = i;
+    new_inode->nlinks = 1;                                            // Default link count
+    new_inode->atim = new_inode->mtim = new_inode->ctim = time(NULL); // Initialize times
+    return i;
+}
+
+static struct wfs_extent_header *extent_root(struct wfs_inode *inode)
+{
+    return (struct wfs_extent_header *)inode->blocks;
+}
+
+static struct wfs_extent_header *extent_node(off_t node_ptr, enum image_access access)
+{
+    return image_block(node_ptr, access);
+}
+
+static struct wfs_extent *extent_records(struct wfs_extent_header *node)
+{
+    return (struct wfs_extent *)(node + 1);
+}
+
+static void extent_init_root(struct wfs_inode *inode)
+{
+    memset(inode->blocks, 0, sizeof(inode->blocks));
+    struct wfs_extent_header *root = extent_root(inode);
+    root->magic = WFS_EXTENT_MAGIC;
+    root->max = EXTENT_ROOT_MAX;
+}
+
+// Returns how many records of node start at or before lblock
+static int extent_upper(struct wfs_extent_header *node, uint32_t lblock)
+{
+    struct wfs_extent *records = extent_records(node);
+    int lo = 0;
+    int hi = node->entries;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (records[mid].lblock <= lblock)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Node blocks an insert sets aside before it changes anything, one for each split it may need
+#define EXTENT_MAX_SPARE (16)
+
+struct extent_spare
+{
+    off_t blocks[EXTENT_MAX_SPARE];
+    int count; // Blocks set aside
+    int used;  // Blocks taken by splits so far
+};
+
+// Returns how many nodes inserting a record for lblock under node splits: the full nodes on the
+// way down to its leaf, counted up from the leaf for as long as they stay full
+static int extent_splits(struct wfs_extent_header *node, uint32_t lblock)
+{
+    int below = 0;
+    if (node->depth > 0)
+    {
+        int i = extent_upper(node, lblock);
+        below = extent_splits(extent_node(extent_records(node)[i > 0 ? i - 1 : 0].start, IMAGE_READ), lblock);
+        if (below == 0)
+            return 0; // The child takes the record without splitting
+    }
+    return node->entries == node->max ? below + 1 : below;
+}
+
+// Inserts rec at position i of node. A full block node is split in two and 1 is returned with the
+// index record for the new right half in *split; a full root instead moves its records down into a
+// new child, growing the tree by one level. New nodes come out of spare.
+static int extent_node_insert(struct wfs_extent_header *node, bool is_root, int i, struct wfs_extent rec, struct wfs_extent *split, struct extent_spare *spare)
+{
+    struct wfs_extent *records = extent_records(node);
+    if (node->entries < node->max)
+    {
+        memmove(&records[i + 1], &records[i], (node->entries - i) * sizeof(struct wfs_extent));
+        records[i] = rec;
+        node->entries++;
+        return 0;
+    }
+
+    off_t new_ptr = spare->blocks[spare->used++];
+    struct wfs_extent_header *new_node = extent_node(new_ptr, IMAGE_WRITE);
+    struct wfs_extent *new_records = extent_records(new_node);
+    new_node->magic = WFS_EXTENT_MAGIC;
+    new_node->max = EXTENT_NODE_MAX;
+    new_node->depth = node->depth;
+
+    if (is_root)
+    {
+        memcpy(new_records, records, node->entries * sizeof(struct wfs_extent));
+        new_node->entries = node->entries;
+        node->depth++;
+        node->entries = 1;
+        records[0] = (struct wfs_extent){.lblock = new_records[0].lblock, .start = new_ptr};
+        return extent_node_insert(new_node, false, i, rec, split, spare);
+    }
+
+    // Appends leave the left node full, so a file written front to back packs its nodes
+    int entries = node->entries;
+    int keep = i == entries ? entries : entries / 2;
+    memcpy(new_records, &records[keep], (entries - keep) * sizeof(struct wfs_extent));
+    new_node->entries = entries - keep;
+    node->entries = keep;
+    if (i < entries && i <= keep)
+        extent_node_insert(node, false, i, rec, NULL, spare);
+    else
+        extent_node_insert(new_node, false, i - keep, rec, NULL, spare);
+
+    *split = (struct wfs_extent){.lblock = new_records[0].lblock, .start = new_ptr};
+    return 1;
+}
+
+// Maps len blocks from lblock to the blocks from byte offset start within the subtree under node
+static int extent_insert_at(struct wfs_extent_header *node, bool is_root, uint32_t lblock, off_t start, uint32_t len, struct wfs_extent *split, struct extent_spare *spare)
+{
+    struct wfs_extent *records = extent_records(node);
+    int i = extent_upper(node, lblock);
+    if (node->depth > 0)
+    {
+        // The child whose range holds lblock; the first child also takes anything before it
+        int c = i > 0 ? i - 1 : 0;
+        struct wfs_extent child_split;
+        if (extent_insert_at(extent_node(records[c].start, IMAGE_WRITE), false, lblock, start, len, &child_split, spare) == 0)
+            return 0;
+        return extent_node_insert(node, is_root, c + 1, child_split, split, spare);
+    }
+
+    // Grow a neighbouring extent when the run continues it both logically and on disk
+    struct wfs_extent *prev = i > 0 ? &records[i - 1] : NULL;
+    struct wfs_extent *next = i < node->entries ? &records[i] : NULL;
+    bool joins_prev = prev && prev->lblock + prev->len == lblock && prev->start + (off_t)prev->len * block_size == start;
+    bool joins_next = next && lblock + len == next->lblock && start + (off_t)len * block_size == next->start;
+    if (joins_prev && joins_next)
+    {
+        prev->len += len + next->len;
+        memmove(next, next + 1, (node->entries - i - 1) * sizeof(struct wfs_extent));
+        node->entries--;
+        return 0;
+    }
+    if (joins_prev)
+    {
+        prev->len += len;
+        return 0;
+    }
+    if (joins_next)
+    {
+        next->lblock = lblock;
+        next->start = start;
+        next->len += len;
+        return 0;
+    }
+    return extent_node_insert(node, is_root, i, (struct wfs_extent){.lblock = lblock, .len = len, .start = start}, split, spare);
+}
+
+static int extent_insert(struct wfs_inode *inode, uint32_t lblock, off_t start, uint32_t len)
+{
+    // Allocate the blocks for the splits up front, so running out of space cannot leave a split
+    // half recorded. Other threads may allocate meanwhile, so checking the free count would not do.
+    struct wfs_extent_header *root = extent_root(inode);
+    struct extent_spare spare = {.count = extent_splits(root, lblock)};
+    if (spare.count > EXTENT_MAX_SPARE)
+    {
+        return -EFBIG;
+    }
+    int ret = 0;
+    long near = block_index(start); // Keep new nodes in the group of the blocks they map
+    for (int k = 0; k < spare.count; k++)
+    {
+        spare.blocks[k] = allocate_block(near == -1 ? 0 : near / blocks_per_group);
+        if (spare.blocks[k] == -1)
+        {
+            spare.count = k;
+            ret = -ENOSPC;
+            break;
+        }
+    }
+    if (ret == 0)
+    {
+        struct wfs_extent split;
+        extent_insert_at(root, true, lblock, start, len, &split, &spare); // The root never splits
+    }
+
+    // Blocks left over belong to an insert that failed or joined a neighbouring extent instead
+    for (int k = spare.used; k < spare.count; k++)
+    {
+        free_block(spare.blocks[k]);
+    }
+    return ret;
+}
+
+// Returns the leaf record that maps lblock for the caller to change, or NULL
+static struct wfs_extent *extent_lookup(struct wfs_extent_header *node, uint32_t lblock)
+{
+    for (;;)
+    {
+        struct wfs_extent *records = extent_records(node);
+        int i = extent_upper(node, lblock);
+        if (node->depth == 0)
+        {
+            struct wfs_extent *rec = i > 0 ? &records[i - 1] : NULL;
+            return rec && lblock < rec->lblock + rec->len ? rec : NULL;
+        }
+        node = extent_node(records[i > 0 ? i - 1 : 0].start, IMAGE_WRITE);
+    }
+}
+
+// Frees blocks [from, to) under node, trimming or dropping the records that map them. No record
+// may extend past both ends of the range.
+static void extent_remove(struct wfs_extent_header *node, uint32_t from, uint32_t to)
+{
+    struct wfs_extent *records = extent_records(node);
+    if (node->depth > 0)
+    {
+        // Child i holds the records from its key up to the next child's key. A child left empty is
+        // freed and its record dropped; lookups below the first key still land on child 0.
+        int i = 0;
+        while (i < node->entries && (i == 0 || records[i].lblock < to))
+        {
+            if (i + 1 < node->entries && records[i + 1].lblock <= from)
+            {
+                i++;
+                continue;
+            }
+            struct wfs_extent_header *child = extent_node(records[i].start, IMAGE_WRITE);
+            extent_remove(child, from, to);
+            if (child->entries == 0)
+            {
+                free_block(records[i].start);
+                memmove(&records[i], &records[i + 1], (node->entries - i - 1) * sizeof(struct wfs_extent));
+                node->entries--;
+                continue;
+            }
+            i++;
+        }
+        return;
+    }
+
+    int i = 0;
+    while (i < node->entries)
+    {
+        struct wfs_extent *rec = &records[i];
+        uint32_t end = rec->lblock + rec->len;
+        if (end <= from || rec->lblock >= to)
+        {
+            i++;
+            continue;
+        }
+        uint32_t cut_from = max(rec->lblock, from);
+        uint32_t cut_to = min(end, to);
+        free_blocks(rec->start + (off_t)(cut_from - rec->lblock) * block_size, cut_to - cut_from);
+
+        if (cut_from == rec->lblock && cut_to == end)
+        {
+            memmove(rec, rec + 1, (node->entries - i - 1) * sizeof(struct wfs_extent));
+            node->entries--;
+            continue;
+        }
+        if (cut_from == rec->lblock)
+        {
+            rec->start += (off_t)(cut_to - rec->lblock) * block_size;
+            rec->lblock = cut_to;
+        }
+        rec->len -= cut_to - cut_from;
+        i++;
+    }
+}
+
+// Unmaps and frees blocks [from, to) of an extent-mapped file
+static int extent_punch(struct wfs_inode *inode, uint32_t from, uint32_t to)
+{
+    struct wfs_extent *rec = extent_lookup(extent_root(inode), from);
+    if (rec && rec->lblock < from && rec->lblock + rec->len > to)
+    {
+        // The range falls inside one extent. Its tail needs a record of its own, which is the only
+        // step that can fail, so add that first and only then cut the extent short.
+        uint32_t end = rec->lblock + rec->len;
+        int ret = extent_insert(inode, to, rec->start + (off_t)(to - rec->lblock) * block_size, end - to);
+        if (ret != 0)
+            return ret;
+        rec = extent_lookup(extent_root(inode), from); // Inserting may have moved it
+        rec->len = to - rec->lblock;
+    }
+    extent_remove(extent_root(inode), from, to);
+    if (extent_root(inode)->entries == 0)
+    {
+        extent_init_root(inode); // Every child went, so the root is a leaf again
+    }
+    return 0;
+}
+
+// Adds every extent under node to the in-core map, in order
+static int extent_walk(struct wfs_extent_header *node, struct open_file *of)
+{
+    struct wfs_extent *records = extent_records(node);
+    for (int i = 0; i < node->entries; i++)
+    {
+        int ret = node->depth > 0 ? extent_walk(extent_node(records[i].start, IMAGE_READ), of)
+                                  : map_append(of, records[i].lblock, records[i].start, records[i].len);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+// Frees the data blocks under node and every node below it
+static void extent_free(struct wfs_extent_header *node)
+{
+    struct wfs_extent *records = extent_records(node);
+    for (int i = 0; i < node->entries; i++)
+    {
+        if (node->depth > 0)
+        {
+            extent_free(extent_node(records[i].start, IMAGE_READ));
+            free_block(records[i].start);
+            continue;
+        }
+        free_blocks(records[i].start, records[i].len);
+    }
+}
+
+// Returns the pointer to logical block b of a block-mapped file, descending through as many
+// indirect levels as b needs. Missing indirect blocks are allocated if alloc is set; otherwise, or
+// when the disk is full, NULL is returned.
+static off_t *blockmap_slot(struct wfs_inode *inode, off_t b, bool alloc)
+{
+    if (b < D_BLOCK)
+    {
+        return &inode->blocks[b];
+    }
+
+    // Pick the tree covering b: each level multiplies the span by PTRS_PER_BLOCK
+    off_t *slot = &inode->blocks[IND_BLOCK];
+    int levels = 1;
+    off_t span = PTRS_PER_BLOCK;
+    b -= D_BLOCK;
+    if (b >= span)
+    {
+        b -= span;
+        slot = &inode->blocks[DIND_BLOCK];
+        levels = 2;
+        span *= PTRS_PER_BLOCK;
+        if (b >= span)
+        {
+            b -= span;
+            slot = &inode->tind;
+            levels = 3;
+            span *= PTRS_PER_BLOCK;
+        }
+    }
+
+    for (int level = levels; level > 0; level--)
+    {
+        if (*slot == 0)
+        {
+            if (!alloc)
+                return NULL;
+            off_t indirect_block = allocate_block(inode_group(inode->num)); // Already zeroed, so every entry is unallocated
+            if (indirect_block == -1)
+                return NULL;
+            *slot = indirect_block;
+        }
+        span /= PTRS_PER_BLOCK;
+        slot = (off_t *)image_block(*slot, IMAGE_WRITE) + b / span;
+        b %= span;
+    }
+    return slot;
+}
+
+// Points logical block b of a block-mapped file at block_ptr
+static int blockmap_insert(struct wfs_inode *inode, off_t b, off_t block_ptr)
+{
+    off_t *slot = blockmap_slot(inode, b, true);
+    if (!slot)
+    {
+        return -ENOSPC;
+    }
+    *slot = block_ptr;
+    return 0;
+}
+
+// Adds the data blocks under an indirect block to the in-core map. Level 1 points at data blocks,
+// and first is the logical block its first entry covers.
+static int blockmap_walk(struct open_file *of, off_t block_ptr, int level, off_t first)
+{
+    off_t *ptrs = image_block(block_ptr, IMAGE_READ);
+    off_t span = 1;
+    for (int l = 1; l < level; l++)
+    {
+        span *= PTRS_PER_BLOCK;
+    }
+    for (int i = 0; i < PTRS_PER_BLOCK; i++)
+    {
+        if (ptrs[i] == 0)
+            continue;
+        int ret = level == 1 ? map_append(of, first + i, ptrs[i], 1)
+                             : blockmap_walk(of, ptrs[i], level - 1, first + i * span);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int blockmap_build(struct wfs_inode *inode, struct open_file *of)
+{
+    for (int b = 0; b < D_BLOCK; b++)
+    {
+        if (inode->blocks[b] != 0 && map_append(of, b, inode->blocks[b], 1) != 0)
+            return -ENOMEM;
+    }
+
+    off_t roots[] = {inode->blocks[IND_BLOCK], inode->blocks[DIND_BLOCK], inode->tind};
+    off_t first = D_BLOCK;
+    off_t span = PTRS_PER_BLOCK;
+    for (int level = 1; level <= 3; level++)
+    {
+        if (roots[level - 1] != 0)
+        {
+            int ret = blockmap_walk(of, roots[level - 1], level, first);
+            if (ret != 0)
+                return ret;
+        }
+        first += span;
+        span *= PTRS_PER_BLOCK;
+    }
+    return 0;
+}
+
+// Counts the data blocks under an indirect block of the given level
+static off_t blockmap_count(off_t block_ptr, int level)
+{
+    off_t *ptrs = image_block(block_ptr, IMAGE_READ);
+    off_t count = 0;
+    for (int i = 0; i < PTRS_PER_BLOCK; i++)
+    {
+        if (ptrs[i] != 0)
+            count += level == 1 ? 1 : blockmap_count(ptrs[i], level - 1);
+    }
+    return count;
+}
+
+static off_t extent_count(struct wfs_extent_header *node)
+{
+    struct wfs_extent *records = extent_records(node);
+    off_t count = 0;
+    for (int i = 0; i < node->entries; i++)
+    {
+        count += node->depth > 0 ? extent_count(extent_node(records[i].start, IMAGE_READ)) : records[i].len;
+    }
+    return count;
+}
+
+// Returns how many data blocks a file or directory has allocated, holes excluded
+static off_t inode_data_blocks(struct wfs_inode *inode)
+{
+    struct open_file *of = open_files[inode->num];
+    off_t count = 0;
+    if (of)
+    {
+        for (int i = 0; i < of->map_len; i++)
+        {
+            count += of->map[i].len;
+        }
+        return count;
+    }
+    if (inode->flags & WFS_INODE_INLINE_DATA)
+    {
+        return 0;
+    }
+    if (inode->flags & WFS_INODE_EXTENTS)
+    {
+        return extent_count(extent_root(inode));
+    }
+
+    for (int b = 0; b < D_BLOCK; b++)
+    {
+        count += inode->blocks[b] != 0;
+    }
+    off_t roots[] = {inode->blocks[IND_BLOCK], inode->blocks[DIND_BLOCK], inode->tind};
+    for (int level = 1; level <= 3; level++)
+    {
+        if (roots[level - 1] != 0)
+            count += blockmap_count(roots[level - 1], level);
+    }
+    return count;
+}
+
+// Adds delta to the inode's count of allocated data blocks. Called before the blocks are mapped
+// or unmapped, so an inode without a count yet can take it from the map as it stands.
+static void count_blocks(struct wfs_inode *inode, long delta)
+{
+    if (!(inode->flags & WFS_INODE_BLOCK_COUNT))
+    {
+        inode->nblocks = inode_data_blocks(inode);
+        inode->flags |= WFS_INODE_BLOCK_COUNT;
+    }
+    inode->nblocks += delta;
+}
+
+// Frees an indirect block of the given level and everything under it
+static void blockmap_free(off_t block_ptr, int level)
+{
+    off_t *ptrs = image_block(block_ptr, IMAGE_READ);
+    // Data blocks written in order mostly lie one after another, so free them a run at a time
+    off_t run = 0;
+    size_t run_len = 0;
+    for (int i = 0; i < PTRS_PER_BLOCK; i++)
+    {
+        if (ptrs[i] == 0)
+            continue;
+        if (level > 1)
+        {
+            blockmap_free(ptrs[i], level - 1);
+            continue;
+        }
+        if (run_len > 0 && ptrs[i] == run + (off_t)run_len * block_size)
+        {
+            run_len++;
+            continue;
+        }
+        if (run_len > 0)
+            free_blocks(run, run_len);
+        run = ptrs[i];
+        run_len = 1;
+    }
+    if (run_len > 0)
+        free_blocks(run, run_len);
+    free_block(block_ptr);
+}
+
+// Clears the pointers to logical blocks from to to under an indirect block of the given level,
+// whose first entry covers logical block first, and frees the indirect blocks that end up empty.
+// The data blocks themselves are left to the caller.
+static void blockmap_trim(off_t *slot, int level, off_t first, off_t from, off_t to)
+{
+    off_t *ptrs = image_block(*slot, IMAGE_WRITE);
+    off_t span = 1;
+    for (int l = 1; l < level; l++)
+    {
+        span *= PTRS_PER_BLOCK;
+    }
+    bool empty = true;
+    for (int i = 0; i < PTRS_PER_BLOCK; i++)
+    {
+        off_t lo = first + i * span;
+        if (ptrs[i] != 0 && lo + span > from && lo < to)
+        {
+            if (level == 1)
+                ptrs[i] = 0;
+            else
+                blockmap_trim(&ptrs[i], level - 1, lo, from, to);
+        }
+        empty = empty && ptrs[i] == 0;
+    }
+    if (empty)
+    {
+        free_block(*slot);
+        *slot = 0;
+    }
+}
+
+// Records on disk that logical block b of a file lives at block_ptr
+static int file_block_map(struct wfs_inode *inode, uint32_t b, off_t block_ptr)
+{
+    return (inode->flags & WFS_INODE_EXTENTS) ? extent_insert(inode, b, block_ptr, 1)
+                                              : blockmap_insert(inode, b, block_ptr);
+}
+
+// Allocates logical block b of a file, returning its byte offset or -1 when the disk is full
+static off_t file_block_alloc(struct wfs_inode *inode, uint32_t b)
+{
+    off_t new_block = allocate_block(inode_group(inode->num));
+    if (new_block == -1)
+    {
+        return -1;
+    }
+    int ret = file_block_map(inode, b, new_block);
+    if (ret != 0)
+    {
+        free_block(new_block);
+        return -1;
+    }
+    return new_block;
+}
+
+static off_t file_max_size(struct wfs_inode *inode)
+{
+    // Block numbers are 32 bits in the in-core map, which also caps block-mapped files with large blocks
+    off_t max_blocks = (inode->flags & WFS_INODE_EXTENTS) ? EXTENT_MAX_BLOCKS : min(FILE_MAX_BLOCKS, EXTENT_MAX_BLOCKS);
+    return max_blocks * block_size;
+}
+
+// Moves an inline file's data out to a block of its own so that the file can grow past its slot
+static int inline_promote(struct open_file *of, struct wfs_inode *inode)
+{
+    int flags = inode->flags;
+    inode->flags &= ~WFS_INODE_INLINE_DATA;
+    if (sb.features & WFS_FEATURE_EXTENTS)
+    {
+        inode->flags |= WFS_INODE_EXTENTS;
+        extent_init_root(inode);
+    }
+
+    if (inode->size > 0)
+    {
+        off_t block = -1;
+        if (of->map_len < of->map_cap || map_grow(of) == 0)
+        {
+            block = file_block_alloc(inode, 0);
+        }
+        if (block == -1)
+        {
+            inode->flags = flags;
+            memset(inode->blocks, 0, sizeof(inode->blocks));
+            return -ENOSPC;
+        }
+        memcpy(image_block(block, IMAGE_WRITE), inline_data(inode), inode->size);
+        map_add(of, 0, block);
+    }
+    memset(inline_data(inode), 0, INLINE_MAX);
+    return 0;
+}
+
+// Returns the blocks a file set aside but never used to the free space. They were never marked
+// used on disk, so only the in-memory bitmap changes.
+static void reserve_release(struct open_file *of)
+{
+    if (of->reserved_len > 0)
+    {
+        long i = block_index(of->reserved);
+        struct alloc_group *group = &groups[i / blocks_per_group];
+        bitmap_clear_run(&group->avail_bits, i % blocks_per_group, of->reserved_len);
+    }
+    of->reserved_len = 0;
+}
+
+// Returns where logical block lblock would continue the file on disk: right after the block
+// mapped at lblock - 1, or -1 if there is none
+static off_t file_goal(struct open_file *of, uint32_t lblock)
+{
+    if (lblock == 0)
+    {
+        return -1;
+    }
+    int i = map_find(of, lblock - 1);
+    if (i == of->map_len || of->map[i].lblock > lblock - 1)
+    {
+        return -1;
+    }
+    return of->map[i].start + (off_t)(lblock - of->map[i].lblock) * block_size;
+}
+
+// Allocates up to n contiguous blocks for a file from logical block lblock, returning the byte
+// offset of the first and the count in *count, or -1 when the disk is full. The blocks come from
+// the file's reservation when it continues the file, else from right after the previous block,
+// else from anywhere; a fresh run is taken window blocks longer and the rest kept in reserve.
+static off_t file_alloc_blocks(struct open_file *of, uint32_t lblock, size_t n, size_t *count)
+{
+    off_t goal = file_goal(of, lblock);
+    if (of->reserved_len > 0 && goal == of->reserved)
+    {
+        *count = min(n, of->reserved_len);
+        of->reserved += (off_t)*count * block_size;
+        of->reserved_len -= *count;
+        if (of->reserved_len == 0)
+        {
+            of->window = min(of->window * 2, RESERVE_MAX_BLOCKS); // Sequential so far: set more aside next time
+        }
+        use_blocks(goal, *count);
+        return goal;
+    }
+
+    size_t want = n + of->window;
+    size_t total = 0;
+    off_t start = -1;
+    if (goal != -1)
+    {
+        // Grow in place over whatever is free right after the previous block
+        long i = block_index(goal);
+        if (i != -1)
+        {
+            total = bitmap_alloc_at(&groups[i / blocks_per_group].avail_bits, i % blocks_per_group, want);
+        }
+        start = total > 0 ? goal : -1;
+    }
+    if (start == -1)
+    {
+        start = allocate_blocks(inode_group(of->num), want, &total);
+    }
+    if (start == -1 && of->reserved_len > 0)
+    {
+        // The disk is full but for the old reservation, which is better used here
+        reserve_release(of);
+        start = allocate_blocks(inode_group(of->num), n, &total);
+    }
+    if (start == -1)
+    {
+        return -1;
+    }
+
+    *count = min(n, total);
+    use_blocks(start, *count);
+    if (total > *count)
+    {
+        reserve_release(of);
+        of->reserved = start + (off_t)*count * block_size;
+        of->reserved_len = total - *count;
+    }
+    return start;
+}
+
+// Records block_ptr as logical block lblock of an open file, on disk and in its map
+static int file_map_block(struct open_file *of, struct wfs_inode *inode, uint32_t lblock, off_t block_ptr)
+{
+    // Make room in the map first so that recording a block cannot fail once it is on disk
+    if (of->map_len == of->map_cap && map_grow(of) != 0)
+    {
+        return -ENOMEM;
+    }
+    int ret = file_block_map(inode, lblock, block_ptr);
+    if (ret != 0 && of->reserved_len > 0)
+    {
+        reserve_release(of); // A pointer block may need space the reservation is holding
+        ret = file_block_map(inode, lblock, block_ptr);
+    }
+    if (ret != 0)
+    {
+        return ret;
+    }
+    map_add(of, lblock, block_ptr);
+    return 0;
+}
+
+// Allocates and maps up to n blocks from lblock, all in one run when the free space allows, for a
+// write of [pos, end). Only the bytes of the new blocks that the write will not cover are zeroed.
+// Returns how many blocks were mapped.
+static uint32_t write_alloc(struct open_file *of, struct wfs_inode *inode, uint32_t lblock, uint32_t n, off_t pos, off_t end)
+{
+    size_t count;
+    off_t start = file_alloc_blocks(of, lblock, n, &count);
+    if (start == -1)
+    {
+        return 0;
+    }
+
+    size_t k = 0;
+    for (; k < count; k++)
+    {
+        if (file_map_block(of, inode, lblock + k, start + (off_t)k * block_size) != 0)
+            break;
+    }
+    if (k < count)
+    {
+        free_blocks(start + (off_t)k * block_size, count - k);
+    }
+    if (k == 0)
+    {
+        return 0;
+    }
+
+    // The head and tail only need clearing where their block may hold old data
+    size_t dirty = claim_blocks(start, k);
+    off_t first = (off_t)lblock * block_size;
+    off_t last = (off_t)(lblock + k) * block_size;
+    if (pos > first && dirty > 0)
+    {
+        zero_data(start, 0, pos - first);
+    }
+    if (end < last && dirty == k)
+    {
+        zero_data(start, end - first, last - end);
+    }
+    return k;
+}
+
+// Copies size bytes from src to mem, returning how many arrived. Bytes a short copy leaves
+// unwritten are zeroed when they lie past end, the file size, where they would otherwise expose
+// whatever the block held before; the caller clears those in blocks it has just allocated.
+static size_t write_copy(struct fuse_bufvec *src, char *mem, size_t size, off_t pos, off_t end)
+{
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = mem;
+    ssize_t copied = fuse_buf_copy(&dst, src, 0);
+    copied = max(copied, 0);
+    if ((size_t)copied < size)
+    {
+        off_t from = max(pos + copied, end);
+        if (from < pos + (off_t)size)
+            memset(mem + (from - pos), 0, pos + size - from);
+    }
+    return copied;
+}
+
+// Copies size bytes from src into an open file at offset, returning the count or a negative
+// errno. src may be memory or a pipe; either way it goes into each run of blocks in one copy.
+static int write_inode(struct open_file *of, struct fuse_bufvec *src, size_t size, off_t offset)
+{
+    struct wfs_inode *inode = inode_at(of->num);
+    if (inode->flags & WFS_INODE_INLINE_DATA)
+    {
+        if (offset + (off_t)size <= INLINE_MAX)
+        {
+            size_t copied = write_copy(src, inline_data(inode) + offset, size, offset, inode->size);
+            if (copied == 0 && size > 0)
+            {
+                return -EIO;
+            }
+            size = copied;
+            if (offset + (off_t)size > inode->size)
+            {
+                inode->size = offset + size;
+            }
+            inode->mtim = time(NULL); // Update the modification time
+            return size;
+        }
+        int ret = inline_promote(of, inode);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+
+    off_t max_size = file_max_size(inode);
+    if (offset >= max_size)
+    {
+        return -EFBIG;
+    }
+    size = min(size, max_size - offset);
+
+    size_t bytes_written = 0;
+    off_t fresh_ptr = 0, fresh_from = 0, fresh_to = 0; // The blocks allocated last, left unzeroed for the copy
+    while (bytes_written < size)
+    {
+        off_t pos = offset + bytes_written;
+        uint32_t lblock = pos / block_size;
+        int i = map_find(of, lblock);
+        if (i == of->map_len || of->map[i].lblock > lblock)
+        {
+            // Allocate every block of the hole that this write covers in one go
+            uint32_t last = (offset + size - 1) / block_size + 1;
+            uint32_t hole_end = i < of->map_len ? min(last, of->map[i].lblock) : last;
+            uint32_t k = write_alloc(of, inode, lblock, hole_end - lblock, pos, offset + size);
+            if (k == 0)
+                break;
+            i = map_find(of, lblock);
+            fresh_ptr = of->map[i].start + (off_t)(lblock - of->map[i].lblock) * block_size;
+            fresh_from = (off_t)lblock * block_size;
+            fresh_to = (off_t)(lblock + k) * block_size;
+        }
+
+        // Fill as much of the run as the write covers in one copy, or of the block when cached
+        struct wfs_extent *run = &of->map[i];
+        off_t run_offset = pos - (off_t)run->lblock * block_size;
+        size_t chunk = min(size - bytes_written, (off_t)run->len * block_size - run_offset);
+        char *mem = image_data(run->start, run_offset, &chunk, IMAGE_OVERWRITE);
+        size_t copied = write_copy(src, mem, chunk, pos, inode->size);
+        bytes_written += copied;
+        if (copied < chunk)
+        {
+            // The new blocks were only zeroed where the write would not reach, so clear what it missed
+            off_t from = max(pos + (off_t)copied, fresh_from);
+            if (from < fresh_to)
+                zero_data(fresh_ptr, from - fresh_from, fresh_to - from);
+            if (bytes_written == 0)
+                return -EIO;
+            break;
+        }
+    }
+    if (bytes_written == 0)
+    {
+        return -ENOSPC;
+    }
+
+    off_t end_offset = offset + bytes_written;
+    if (end_offset > inode->size)
+    {
+        inode->size = end_offset;
+    }
+    inode->mtim = time(NULL); // Update the modification time
+    return bytes_written;
+}
+
+static void wfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi)
+{
+    struct open_file *of = (struct open_file *)(uintptr_t)fi->fh;
+    pthread_rwlock_wrlock(&inode_locks[of->num]);
+    int ret = write_inode(of, bufv, fuse_buf_size(bufv), offset);
+    inode_unlock(of->num);
+    if (ret < 0)
+    {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_write(req, ret);
+}
+
+// libfuse calls write_buf when it is set; this is the same for callers that hold a plain buffer
+static void wfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].mem = (void *)buf;
+    wfs_write_buf(req, ino, &bufv, offset, fi);
+}
+
+// Gives every unmapped block of [offset, offset + length) a zeroed block, taking contiguous runs
+static int allocate_range(struct open_file *of, off_t offset, off_t length, bool keep_size)
+{
+    struct wfs_inode *inode = inode_at(of->num);
+    off_t end = offset + length;
+    if ((inode->flags & WFS_INODE_INLINE_DATA) && end > INLINE_MAX)
+    {
+        int ret = inline_promote(of, inode);
+        if (ret != 0)
+            return ret;
+    }
+    if (end > file_max_size(inode))
+    {
+        return -EFBIG;
+    }
+
+    int ret = 0;
+    uint32_t b = offset / block_size;
+    uint32_t last = (end + block_size - 1) / block_size;
+    while (!(inode->flags & WFS_INODE_INLINE_DATA) && b < last)
+    {
+        int i = map_find(of, b);
+        if (i < of->map_len && of->map[i].lblock <= b)
+        {
+            b = of->map[i].lblock + of->map[i].len; // Already mapped
+            continue;
+        }
+
+        // Fill the hole up to the next run with as few runs of disk as the free space allows
+        uint32_t hole_end = i < of->map_len ? min(last, of->map[i].lblock) : last;
+        size_t count;
+        off_t start = file_alloc_blocks(of, b, hole_end - b, &count);
+        if (start == -1)
+        {
+            ret = -ENOSPC;
+            break;
+        }
+        zero_blocks(start, count);
+        size_t k = 0;
+        for (; k < count; k++, b++)
+        {
+            if (file_map_block(of, inode, b, start + (off_t)k * block_size) != 0)
+                break;
+        }
+        if (k < count)
+        {
+            free_blocks(start + (off_t)k * block_size, count - k);
+            ret = -ENOSPC;
+            break;
+        }
+    }
+
+    if (ret == 0 && !keep_size && end > inode->size)
+    {
+        inode->size = end;
+        inode->mtim = time(NULL);
+    }
+    return ret;
+}
+
+// Zeroes bytes [pos, pos + n) of a file where they are mapped. The range must lie within one block.
+static void zero_in_block(struct open_file *of, off_t pos, size_t n)
+{
+    uint32_t lblock = pos / block_size;
+    int i = map_find(of, lblock);
+    if (i < of->map_len && of->map[i].lblock <= lblock)
+    {
+        zero_data(of->map[i].start, pos - (off_t)of->map[i].lblock * block_size, n);
+    }
+}
+
+// Unmaps blocks from to to of a block-mapped file. The data is freed a run at a time straight
+// from the in-core map; the pointer tree is then cut back, dropping indirect blocks left empty.
+static void blockmap_punch(struct open_file *of, struct wfs_inode *inode, uint32_t from, uint32_t to)
+{
+    for (int i = map_find(of, from); i < of->map_len && of->map[i].lblock < to; i++)
+    {
+        uint32_t start = max(of->map[i].lblock, from);
+        uint32_t end = min(of->map[i].lblock + of->map[i].len, to);
+        free_blocks(of->map[i].start + (off_t)(start - of->map[i].lblock) * block_size, end - start);
+    }
+
+    for (uint32_t b = from; b < min(to, D_BLOCK); b++)
+    {
+        inode->blocks[b] = 0;
+    }
+    off_t *roots[] = {&inode->blocks[IND_BLOCK], &inode->blocks[DIND_BLOCK], &inode->tind};
+    off_t first = D_BLOCK;
+    off_t span = PTRS_PER_BLOCK;
+    for (int level = 1; level <= 3; level++)
+    {
+        if (*roots[level - 1] != 0 && first + span > from && first < to)
+            blockmap_trim(roots[level - 1], level, first, from, to);
+        first += span;
+        span *= PTRS_PER_BLOCK;
+    }
+}
+
+// Makes [offset, offset + length) read as zeros, freeing every block the range covers entirely
+static int punch_range(struct open_file *of, off_t offset, off_t length)
+{
+    struct wfs_inode *inode = inode_at(of->num);
+    off_t end = min(offset + length, file_max_size(inode));
+    if (inode->flags & WFS_INODE_INLINE_DATA)
+    {
+        if (offset < INLINE_MAX)
+            memset(inline_data(inode) + offset, 0, min(end, INLINE_MAX) - offset);
+        return 0;
+    }
+    if (offset >= end)
+    {
+        return 0;
+    }
+
+    off_t from = (offset + block_size - 1) / block_size;
+    off_t to = end / block_size;
+    if (from > to)
+    {
+        zero_in_block(of, offset, end - offset); // Inside a single block
+        return 0;
+    }
+    if (offset < from * block_size)
+    {
+        zero_in_block(of, offset, from * block_size - offset);
+    }
+    if (end > to * block_size)
+    {
+        zero_in_block(of, to * block_size, end - to * block_size);
+    }
+    if (from == to)
+    {
+        return 0;
+    }
+
+    if (of->map_len == of->map_cap && map_grow(of) != 0)
+    {
+        return -ENOMEM;
+    }
+    if (inode->flags & WFS_INODE_EXTENTS)
+    {
+        int ret = extent_punch(inode, from, to);
+        if (ret != 0)
+            return ret;
+    }
+    else
+    {
+        blockmap_punch(of, inode, from, to);
+    }
+    map_remove(of, from, to);
+    return 0;
+}
+
+// Sets a file's size. Shrinking frees every block past the new end and zeroes the rest of the
+// last block, so that growing the file again reads zeros there.
+static int truncate_file(struct open_file *of, off_t size)
+{
+    struct wfs_inode *inode = inode_at(of->num);
+    if (size > file_max_size(inode))
+    {
+        return -EFBIG;
+    }
+    if ((inode->flags & WFS_INODE_INLINE_DATA) && size > INLINE_MAX)
+    {
+        int ret = inline_promote(of, inode);
+        if (ret != 0)
+            return ret;
+    }
+
+    if (size < inode->size && (inode->flags & WFS_INODE_INLINE_DATA))
+    {
+        memset(inline_data(inode) + size, 0, INLINE_MAX - size);
+    }
+    else if (size < inode->size)
+    {
+        if (size % block_size)
+        {
+            zero_in_block(of, size, block_size - size % block_size);
+        }
+        uint32_t from = (size + block_size - 1) / block_size;
+        if (inode->flags & WFS_INODE_EXTENTS)
+        {
+            extent_punch(inode, from, EXTENT_MAX_BLOCKS); // Cannot fail: no extent reaches past the end
+        }
+        else
+        {
+            blockmap_punch(of, inode, from, EXTENT_MAX_BLOCKS);
+        }
+        map_remove(of, from, EXTENT_MAX_BLOCKS);
+        reserve_release(of); // Set aside for growth past an end that is now gone
+    }
+    inode->size = size;
+    inode->mtim = inode->ctim = time(NULL);
+    return 0;
+}
+
+static void wfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    struct open_file *of = (struct open_file *)(uintptr_t)fi->fh;
+    pthread_rwlock_wrlock(&inode_locks[of->num]);
+    int ret;
+    if (offset < 0 || length <= 0)
+    {
+        ret = -EINVAL;
+    }
+    else if (mode == 0 || mode == FALLOC_FL_KEEP_SIZE)
+    {
+        ret = allocate_range(of, offset, length, mode & FALLOC_FL_KEEP_SIZE);
+    }
+    else if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+    {
+        ret = punch_range(of, offset, length);
+    }
+    else
+    {
+        ret = -EOPNOTSUPP;
+    }
+    if (ret == 0)
+    {
+        inode_at(of->num)->ctim = time(NULL);
+    }
+    inode_unlock(of->num);
+    fuse_reply_err(req, -ret);
+}
+
+// Returns the shared in-core state for a regular file, building its block map on first open.
+// The caller holds the inode's lock for writing, as for open_file_put.
+static struct open_file *open_file_get(struct wfs_inode *inode)
+{
+    struct open_file *of = open_files[inode->num];
+    if (of)
+    {
+        of->refcount++;
+        return of;
+    }
+
+    of = calloc(1, sizeof(struct open_file));
+    if (!of)
+    {
+        return NULL;
+    }
+    of->num = inode->num;
+    of->refcount = 1;
+    of->window = RESERVE_MIN_BLOCKS;
+
+    // Collect the mapping into runs once so I/O never walks the on-disk structures again
+    int ret = 0;
+    if (inode->flags & WFS_INODE_EXTENTS)
+    {
+        ret = extent_walk(extent_root(inode), of);
+    }
+    else if (!(inode->flags & WFS_INODE_INLINE_DATA))
+    {
+        ret = blockmap_build(inode, of);
+    }
+    if (ret != 0)
+    {
+        free(of->map);
+        free(of);
+        return NULL;
+    }
+    open_files[inode->num] = of;
+    return of;
+}
+
+static void open_file_put(struct open_file *of)
+{
+    if (--of->refcount > 0)
+    {
+        return;
+    }
+    open_files[of->num] = NULL;
+    reserve_release(of);
+    if (of->unlinked)
     {
-        off_t *indirect_blocks = (off_t *)((char *)mapped_memory + inode->blocks[IND_BLOCK]);
-        for (int i = 0; i < BLOCK_SIZE / sizeof(off_t) && indirect_blocks[i] != 0; i++)
-        {
-            struct wfs_dentry *dentries = (struct wfs_dentry *)((char *)mapped_memory + indirect_blocks[i]);
-            for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
-            {
-                if (dentries[j].num != 0) // Valid entry
-                {
-                    if (filler(buf, dentries[j].name, NULL, 0) != 0)
-                        return 0; // Buffer full or other filler-related error
-                }
-            }
-        }
+        release_inode(inode_at(of->num)); // The last handle on an unlinked file is gone
     }
-
-    return 0;
+    free(of->map);
+    free(of);
 }
 
-static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static void wfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    printf("Reading from path: %s\n", path);
-    struct wfs_inode *inode = find_inode_by_path(path);
+    struct wfs_inode *inode = inode_lock(ino, true);
     if (!inode)
     {
-        fprintf(stderr, "Error finding inode for path %s\n", path);
-        return -ENOENT;
+        fuse_reply_err(req, ENOENT);
+        return;
     }
-    if (offset >= inode->size)
+    if (!S_ISREG(inode->mode))
     {
-        return 0; // Nothing to read, offset is beyond the end of the file
+        inode_unlock(inode->num);
+        fuse_reply_err(req, EISDIR);
+        return;
     }
-    size_t bytes_to_read = min(size, inode->size - offset);
-    size_t bytes_read = 0;
-    int block_index = offset / BLOCK_SIZE;
-    int block_offset = offset % BLOCK_SIZE;
-    while (bytes_read < bytes_to_read)
+
+    struct open_file *of = open_file_get(inode);
+    inode_unlock(inode->num);
+    if (!of)
     {
-        size_t current_block_index;
-        if (block_index < D_BLOCK)
-        { // Direct block
-            current_block_index = inode->blocks[block_index];
-        }
-        else
-        { // Indirect block
-            if (inode->blocks[IND_BLOCK] == 0)
-            {
-                return -EIO; // Indirect block not initialized
-            }
-            off_t *indirect_blocks = (off_t *)((char *)mapped_memory + inode->blocks[IND_BLOCK]);
-            current_block_index = indirect_blocks[block_index - D_BLOCK];
-        }
-        char *block_data = (char *)mapped_memory + current_block_index;
-        size_t bytes_from_block = min(BLOCK_SIZE - block_offset, bytes_to_read - bytes_read);
-        memcpy(buf + bytes_read, block_data + block_offset, bytes_from_block);
-        bytes_read += bytes_from_block;
-        block_index++;
-        block_offset = 0; // Reset block offset for subsequent blocks
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
-    return bytes_read;
+    fi->fh = (uintptr_t)of;
+    fuse_reply_open(req, fi);
 }
 
-int allocate_block()
+static void wfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    // Access the data bitmap directly from the global variable
-    char *bitmap = data_bitmap;
-
-    // Iterate over the bitmap to find a free block, using the number of data blocks from the global superblock
-    for (size_t i = 0; i < sb.num_data_blocks; i++)
-    {
-        size_t byte_index = i / 8;
-        size_t bit_index = i % 8;
-
-        // Check if the current block is free
-        if (!(bitmap[byte_index] & (1 << bit_index)))
-        {
-            // Mark the block as used
-            bitmap[byte_index] |= (1 << bit_index);
-
-            // Optionally clear the block in data storage if necessary
-            memset((char *)mapped_memory + sb.d_blocks_ptr + i * BLOCK_SIZE, 0, BLOCK_SIZE);
-
-            // Return the offset from the beginning of the data blocks section
-            return sb.d_blocks_ptr + i * BLOCK_SIZE;
-        }
-    }
-
-    // Return -1 if no free blocks are available
-    return -1;
+    struct open_file *of = (struct open_file *)(uintptr_t)fi->fh;
+    int num = of->num;
+    pthread_rwlock_wrlock(&inode_locks[num]);
+    open_file_put(of);
+    inode_unlock(num);
+    fuse_reply_err(req, 0);
 }
-int initialize_indirect_block(struct wfs_inode *inode)
+
+// Called on every close of a file. Like a local filesystem, close does not wait for the disk,
+// but the cache starts writing back rather than holding the file's writes for the next pass.
+static void wfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    int indirect_block_index = allocate_block();
-    if (indirect_block_index == -1)
-        return -ENOSPC;
+    image_writeback();
+    fuse_reply_err(req, 0);
+}
 
-    inode->blocks[IND_BLOCK] = indirect_block_index; // Set indirect block index
-    off_t *block_pointers = (off_t *)((char *)mapped_memory + sb.d_blocks_ptr + indirect_block_index);
-    memset(block_pointers, 0, BLOCK_SIZE); // Initialize all entries to zero
-    return 0;
+// The image is synced as a whole, which covers the inode, its blocks and its directory
+static void wfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, image_sync() == -1 ? errno : 0);
 }
 
-int allocate_inode()
+// Applies the attributes in to_set to a locked inode, returning 0 or a negative errno
+static int set_attributes(struct wfs_inode *inode, struct stat *attr, int to_set)
 {
-    char *bitmap = inode_bitmap;
-    for (size_t i = 1; i < sb.num_inodes; i++)
+    if (to_set & FUSE_SET_ATTR_SIZE)
     {
-        size_t byte_index = i / 8;
-        size_t bit_index = i % 8;
-
-        if (!(bitmap[byte_index] & (1 << bit_index)))
+        if (!S_ISREG(inode->mode))
         {
-            bitmap[byte_index] |= (1 << bit_index);
-
-            struct wfs_inode *new_inode = &inodes[i];
-            memset(new_inode, 0, sizeof(struct wfs_inode)); // Zero out the new inode
-            new_inode->num = i;
-            new_inode->nlinks = 1;                                            // Default link count
-            new_inode->atim = new_inode->mtim = new_inode->ctim = time(NULL); // Initialize times
-
-            // Initialize all direct and indirect block pointers to 0 (no block assigned)
-            for (int j = 0; j < N_BLOCKS; j++)
-            {
-                new_inode->blocks[j] = 0;
-            }
+            return S_ISDIR(inode->mode) ? -EISDIR : -EINVAL;
+        }
+        if (attr->st_size < 0)
+        {
+            return -EINVAL;
+        }
 
-            return i;
+        // truncate(2) arrives without a handle, so take a reference of our own for the block map
+        struct open_file *of = open_file_get(inode);
+        if (!of)
+        {
+            return -ENOMEM;
         }
+        int ret = truncate_file(of, attr->st_size);
+        open_file_put(of);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+
+    time_t now = time(NULL);
+    if (to_set & FUSE_SET_ATTR_MODE)
+    {
+        inode->mode = (inode->mode & S_IFMT) | (attr->st_mode & 07777);
+    }
+    if (to_set & FUSE_SET_ATTR_UID)
+    {
+        inode->uid = attr->st_uid;
+    }
+    if (to_set & FUSE_SET_ATTR_GID)
+    {
+        inode->gid = attr->st_gid;
+    }
+    if (to_set & FUSE_SET_ATTR_ATIME)
+    {
+        inode->atim = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? now : attr->st_atime;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME)
+    {
+        inode->mtim = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? now : attr->st_mtime;
     }
-    return -1; // No free inodes available
+    inode->ctim = now;
+    return 0;
 }
 
-static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static void wfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
 {
-    struct wfs_inode *inode = find_inode_by_path(path);
+    struct wfs_inode *inode = inode_lock(ino, true);
     if (!inode)
-        return -ENOENT;
-    if (!S_ISREG(inode->mode))
-        return -EISDIR;
-
-    off_t end_offset = offset + size;
-    if (end_offset > inode->size)
     {
-        inode->size = end_offset;
-        inode->mtim = time(NULL); // Update the modification time
+        fuse_reply_err(req, ENOENT);
+        return;
     }
 
-    size_t bytes_written = 0;
-    while (bytes_written < size)
+    struct stat stbuf;
+    int ret = set_attributes(inode, attr, to_set);
+    if (ret == 0)
     {
-        off_t block_index = (offset + bytes_written) / BLOCK_SIZE;
-        off_t block_offset = (offset + bytes_written) % BLOCK_SIZE;
-        size_t bytes_to_write = min(BLOCK_SIZE - block_offset, size - bytes_written);
-
-        if (block_index < D_BLOCK)
-        {
-            // Handling direct blocks
-            if (inode->blocks[block_index] == 0)
-            {
-                inode->blocks[block_index] = allocate_block();
-                if (inode->blocks[block_index] == -1)
-                    return -ENOSPC;
-            }
-            char *block_data = (char *)mapped_memory + inode->blocks[block_index];
-            memcpy(block_data + block_offset, buf + bytes_written, bytes_to_write);
-        }
-        else
-        {
-            // Handling indirect blocks
-            if (inode->blocks[IND_BLOCK] == 0)
-            {
-                if (initialize_indirect_block(inode) != 0)
-                    return -ENOSPC;
-            }
-            off_t *indirect_blocks = (off_t *)((char *)mapped_memory + inode->blocks[IND_BLOCK]);
-            int indirect_index = block_index - D_BLOCK;
-            if (indirect_blocks[indirect_index] == 0)
-            {
-                indirect_blocks[indirect_index] = allocate_block();
-                if (indirect_blocks[indirect_index] == -1)
-                    return -ENOSPC;
-            }
-            char *block_data = (char *)mapped_memory + indirect_blocks[indirect_index];
-            memcpy(block_data + block_offset, buf + bytes_written, bytes_to_write);
-        }
-        bytes_written += bytes_to_write;
+        fill_stat(inode, &stbuf);
     }
-
-    return bytes_written;
+    inode_unlock(inode->num);
+    if (ret != 0)
+    {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fuse_reply_attr(req, &stbuf, WFS_TIMEOUT);
 }
 
-static int add_directory_entry(struct wfs_inode *parent_inode, int new_inode_num, const char *new_entry_name)
+// Returns the block index a directory's next block should go at or after: right after its last
+// block, or for the first one a spot that spreads directories over the data region by inode number
+static size_t dir_goal(struct wfs_inode *dir_inode, int b)
 {
-    // Try to add the entry in direct blocks first.
-    for (int i = 0; i < D_BLOCK; i++)
+    for (int k = b - 1; k >= 0; k--)
     {
-        if (parent_inode->blocks[i] == 0)
+        off_t prev = k < D_BLOCK ? dir_inode->blocks[k] : 0;
+        if (k >= D_BLOCK && dir_inode->blocks[IND_BLOCK] != 0)
         {
-            parent_inode->blocks[i] = allocate_block();
-            if (parent_inode->blocks[i] == -1)
-                return -ENOSPC; // No space left
-            memset((char *)mapped_memory + parent_inode->blocks[i], 0, BLOCK_SIZE);
+            prev = ((off_t *)image_block(dir_inode->blocks[IND_BLOCK], IMAGE_READ))[k - D_BLOCK];
         }
-        struct wfs_dentry *dentries = (struct wfs_dentry *)((char *)mapped_memory + parent_inode->blocks[i]);
-        for (int j = 0; j < (BLOCK_SIZE / sizeof(struct wfs_dentry)); j++)
+        if (prev != 0)
         {
-            if (dentries[j].num == 0)
-            {
-                strncpy(dentries[j].name, new_entry_name, MAX_NAME - 1);
-                dentries[j].name[MAX_NAME - 1] = '\0'; // Ensure null termination
-                dentries[j].num = new_inode_num;
-                return 0; // Success
-            }
+            return block_index(prev) + 1;
         }
     }
+    size_t g = inode_group(dir_inode->num);
+    size_t group_blocks = groups[g].data_bits.nbits;
+    return g * blocks_per_group + (dir_inode->num % inodes_per_group) * group_blocks / inodes_per_group;
+}
 
-    // If no space in direct blocks, use the indirect block.
-    if (parent_inode->blocks[IND_BLOCK] == 0)
+// Returns logical dentry block b of a directory, allocating and zeroing it if needed
+static struct wfs_dentry *dir_block_alloc(struct wfs_inode *dir_inode, int b)
+{
+    off_t *block_ptr;
+    if (b < D_BLOCK)
     {
-        parent_inode->blocks[IND_BLOCK] = allocate_block();
-        if (parent_inode->blocks[IND_BLOCK] == -1)
-            return -ENOSPC;
-        memset((char *)mapped_memory + parent_inode->blocks[IND_BLOCK], 0, BLOCK_SIZE);
+        block_ptr = &dir_inode->blocks[b];
     }
-
-    off_t *indirect_blocks = (off_t *)((char *)mapped_memory + parent_inode->blocks[IND_BLOCK]);
-    for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++)
+    else
     {
-        if (indirect_blocks[i] == 0)
-        {
-            indirect_blocks[i] = allocate_block();
-            if (indirect_blocks[i] == -1)
-                return -ENOSPC;
-            memset((char *)mapped_memory + indirect_blocks[i], 0, BLOCK_SIZE);
-        }
-        struct wfs_dentry *dentries = (struct wfs_dentry *)((char *)mapped_memory + indirect_blocks[i]);
-        for (int j = 0; j < (BLOCK_SIZE / sizeof(struct wfs_dentry)); j++)
+        // Past the direct blocks, dentry blocks hang off the indirect block
+        if (dir_inode->blocks[IND_BLOCK] == 0)
         {
-            if (dentries[j].num == 0)
+            dir_inode->blocks[IND_BLOCK] = allocate_block_near(dir_goal(dir_inode, b));
+            if (dir_inode->blocks[IND_BLOCK] == -1)
             {
-                strncpy(dentries[j].name, new_entry_name, MAX_NAME - 1);
-                dentries[j].name[MAX_NAME - 1] = '\0'; // Ensure null termination
-                dentries[j].num = new_inode_num;
-                return 0; // Success
+                dir_inode->blocks[IND_BLOCK] = 0;
+                return NULL;
             }
         }
+        off_t *indirect_blocks = image_block(dir_inode->blocks[IND_BLOCK], IMAGE_WRITE);
+        block_ptr = &indirect_blocks[b - D_BLOCK];
     }
 
-    return -ENOSPC; // No space left anywhere
+    if (*block_ptr == 0)
+    {
+        off_t new_block = allocate_block_near(dir_goal(dir_inode, b));
+        if (new_block == -1)
+        {
+            return NULL; // No space left
+        }
+        count_blocks(dir_inode, 1);
+        *block_ptr = new_block;
+    }
+    return image_block(*block_ptr, IMAGE_WRITE);
 }
 
-static int wfs_mknod(const char *path, mode_t mode, dev_t dev)
+// Stores a dentry at a free slot found by check_new_entry, allocating its block if needed
+static int add_directory_entry(struct wfs_inode *parent_inode, int slot, int new_inode_num, const char *new_entry_name)
 {
-    printf("mknod....\n");
-    // Ensure the file does not already exist
-    struct wfs_inode *existing_inode = find_inode_by_path(path);
-    if (existing_inode != NULL)
+    if (parent_inode->flags & WFS_INODE_DIR_INDEX)
     {
-        return -EEXIST; // File already exists
+        int ret = hashed_dir_insert(parent_inode, new_inode_num, new_entry_name);
+        if (ret != 0)
+            return ret;
+        dcache_insert(parent_inode->num, new_entry_name, new_inode_num);
+        return 0;
     }
 
-    // Find the parent directory inode
-    char *parent_path = strdup(path);
-    if (!parent_path)
-    {
-        return -ENOMEM; // Failed to allocate memory
-    }
+    struct wfs_dentry *dentries = dir_block_alloc(parent_inode, slot / DENTRIES_PER_BLOCK);
+    if (!dentries)
+        return -ENOSPC;
 
-    char *last_slash = strrchr(parent_path, '/');
-    if (!last_slash)
-    {
-        free(parent_path);
-        return -ENOENT; // No parent directory path found
-    }
-    *last_slash = '\0'; // Terminate the parent path string before the last '/'
+    struct wfs_dentry *dentry = &dentries[slot % DENTRIES_PER_BLOCK];
+    strncpy(dentry->name, new_entry_name, MAX_NAME - 1);
+    dentry->name[MAX_NAME - 1] = '\0'; // Ensure null termination
+    dentry->num = new_inode_num;
 
-    struct wfs_inode *parent_inode = find_inode_by_path(parent_path);
-    if (parent_inode == NULL)
-    {
-        free(parent_path);
-        return -ENOENT; // Parent directory does not exist
-    }
-    if (!S_ISDIR(parent_inode->mode))
+    dir_states[parent_inode->num].free_hint = slot + 1;
+    dcache_insert(parent_inode->num, new_entry_name, new_inode_num);
+    return 0; // Success
+}
+
+// Creates a file or directory called name in a directory locked for writing, returning its entry
+// or a negative errno. When of is given, the new file is also opened into it.
+static int create_in(struct wfs_inode *parent_inode, const char *name, mode_t mode, struct fuse_entry_param *e, struct open_file **of)
+{
+    // Make sure the entry does not already exist
+    int slot;
+    int ret = check_new_entry(parent_inode, name, &slot);
+    if (ret != 0)
     {
-        free(parent_path);
-        return -ENOTDIR; // Parent is not a directory
+        return ret;
     }
 
-    // Allocate a new inode for the new file
-    int new_inode_num = allocate_inode();
-    printf("new inode num is %d\n", new_inode_num);
+    // Allocate a new inode for the new entry
+    int new_inode_num = allocate_inode(parent_inode, S_ISDIR(mode));
     if (new_inode_num == -1)
     {
-        free(parent_path);
-        return -ENOSPC;
+        return -ENOSPC; // No space left to create a new inode
     }
 
-    struct wfs_inode *new_inode = (struct wfs_inode *)((char *)mapped_memory + sb.i_blocks_ptr + new_inode_num * BLOCK_SIZE);
+    struct wfs_inode *new_inode = inode_at(new_inode_num);
     new_inode->num = new_inode_num;
     new_inode->mode = mode;
     new_inode->uid = getuid();
     new_inode->gid = getgid();
-    new_inode->size = 0;   // Initially empty
-    new_inode->nlinks = 1; // One link to the file itself
+    new_inode->size = 0;                         // Initially empty
+    new_inode->nlinks = S_ISDIR(mode) ? 2 : 1; // A directory is also linked from its own '.'
     new_inode->atim = time(NULL);
     new_inode->mtim = time(NULL);
     new_inode->ctim = time(NULL);
     memset(new_inode->blocks, 0, sizeof(new_inode->blocks)); // Initialize all blocks to 0
-    // Inside wfs_mknod, after allocating a new inode
-    // Add directory entry for the new file in the parent directory
-    if (add_directory_entry(parent_inode, new_inode_num, last_slash + 1) != 0)
+    if (S_ISDIR(mode) && (sb.features & WFS_FEATURE_DIR_INDEX))
     {
-        free(parent_path);
-        free_inode(new_inode_num); // Cleanup if directory entry addition fails
-        return -EIO;               // Failed to add directory entry
+        new_inode->flags = WFS_INODE_DIR_INDEX;
     }
+    else if (S_ISREG(mode) && (sb.features & WFS_FEATURE_INLINE_DATA))
+    {
+        // Small files never need a data block; the slot may still hold a previous file's data
+        new_inode->flags = WFS_INODE_INLINE_DATA;
+        memset(inline_data(new_inode), 0, INLINE_MAX);
+    }
+    else if (S_ISREG(mode) && (sb.features & WFS_FEATURE_EXTENTS))
+    {
+        new_inode->flags = WFS_INODE_EXTENTS;
+        extent_init_root(new_inode);
+    }
+    new_inode->flags |= WFS_INODE_BLOCK_COUNT; // nblocks was zeroed with the slot
 
-    free(parent_path);
-    return 0;
-}
-
-static int wfs_mkdir(const char *path, mode_t mode)
-{
-    printf("mkdir....\n");
-    // Ensure the directory does not already exist
-    struct wfs_inode *existing_inode = find_inode_by_path(path);
-    if (existing_inode != NULL)
+    // Add directory entry for the new inode in the parent directory
+    ret = add_directory_entry(parent_inode, slot, new_inode_num, name);
+    if (ret != 0)
     {
-        return -EEXIST; // Directory already exists
+        free_inode(new_inode_num); // Cleanup if directory entry addition fails
+        inode_unlock(new_inode_num);
+        return ret;
     }
 
-    // Find the parent directory inode
-    char *parent_path = strdup(path);
-    if (!parent_path)
+    if (S_ISDIR(mode))
     {
-        return -ENOMEM; // Failed to allocate memory
+        // A new directory is empty, so its (absent) entries are trivially all cached
+        pthread_mutex_lock(&dcache_lock);
+        dir_states[new_inode_num].complete = true;
+        pthread_mutex_unlock(&dcache_lock);
+        dir_states[new_inode_num].free_hint = 0;
+        dir_states[new_inode_num].hash_blocks = 0;
+        __atomic_store_n(&dir_states[new_inode_num].parent, parent_inode->num, __ATOMIC_RELAXED);
     }
 
-    char *last_slash = strrchr(parent_path, '/');
-    if (!last_slash)
+    memset(e, 0, sizeof(*e));
+    e->ino = WFS_INO(new_inode_num);
+    e->generation = inode_generations[new_inode_num];
+    e->attr_timeout = WFS_TIMEOUT;
+    e->entry_timeout = WFS_TIMEOUT;
+    fill_stat(new_inode, &e->attr);
+
+    // Open the new file before its parent is unlocked, while nothing else can have reached it
+    if (of)
     {
-        free(parent_path);
-        return -ENOENT; // No parent directory path found
+        *of = open_file_get(new_inode);
     }
-    *last_slash = '\0'; // Terminate the parent path string before the last '/'
+    inode_unlock(new_inode_num);
+    return 0;
+}
 
-    struct wfs_inode *parent_inode = find_inode_by_path(parent_path);
-    if (parent_inode == NULL)
+// Creates a file or directory called name in parent, returning its entry or a negative errno
+static int create_entry(fuse_ino_t parent, const char *name, mode_t mode, struct fuse_entry_param *e, struct open_file **of)
+{
+    struct wfs_inode *parent_inode = inode_lock(parent, true);
+    if (!parent_inode)
     {
-        free(parent_path);
         return -ENOENT; // Parent directory does not exist
     }
-    if (!S_ISDIR(parent_inode->mode))
+    int ret = create_in(parent_inode, name, mode, e, of);
+    inode_unlock(parent_inode->num);
+    return ret;
+}
+
+static void wfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    struct fuse_entry_param e;
+    int ret = create_entry(parent, name, mode, &e, NULL);
+    if (ret != 0)
     {
-        free(parent_path);
-        return -ENOTDIR; // Parent is not a directory
+        fuse_reply_err(req, -ret);
+        return;
     }
+    fuse_reply_entry(req, &e);
+}
 
-    // Allocate a new inode for the new directory
-    int new_inode_num = allocate_inode();
-    printf("new inode num is %d\n", new_inode_num);
-    if (new_inode_num == -1)
+static void wfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    struct fuse_entry_param e;
+    int ret = create_entry(parent, name, S_IFDIR | mode, &e, NULL);
+    if (ret != 0)
     {
-        free(parent_path);
-        return -ENOSPC; // No space left to create a new inode
+        fuse_reply_err(req, -ret);
+        return;
     }
+    fuse_reply_entry(req, &e);
+}
 
-    struct wfs_inode *new_inode = (struct wfs_inode *)((char *)mapped_memory + sb.i_blocks_ptr + new_inode_num * BLOCK_SIZE);
-    new_inode->num = new_inode_num;
-    new_inode->mode = S_IFDIR | mode;
-    new_inode->uid = getuid();
-    new_inode->gid = getgid();
-    new_inode->size = 0;   // Initially empty
-    new_inode->nlinks = 2; // '.' and parent directory '..'
-    new_inode->atim = time(NULL);
-    new_inode->mtim = time(NULL);
-    new_inode->ctim = time(NULL);
-    memset(new_inode->blocks, 0, sizeof(new_inode->blocks)); // Initialize all blocks to 0
-
-    // Add directory entry for the new directory in the parent directory
-    if (add_directory_entry(parent_inode, new_inode_num, last_slash + 1) != 0)
+static void wfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    struct open_file *of; // Opened in the same round trip
+    int ret = create_entry(parent, name, S_IFREG | (mode & ~S_IFMT), &e, &of);
+    if (ret != 0)
     {
-        free(parent_path);
-        return -EIO; // Failed to add directory entry
+        fuse_reply_err(req, -ret);
+        return;
     }
-
-    free(parent_path);
-    return 0;
+    if (!of)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fi->fh = (uintptr_t)of;
+    fuse_reply_create(req, &e, fi);
 }
 
 static int remove_directory_entry(struct wfs_inode *parent_inode, int inode_num, const char *entry_name)
 {
-    printf("removing directory entry %s%d\n", entry_name, inode_num);
-    for (int i = 0; i < N_BLOCKS && parent_inode->blocks[i] != 0; i++)
+    if (parent_inode->flags & WFS_INODE_DIR_INDEX)
+    {
+        return hashed_dir_remove(parent_inode, inode_num, entry_name);
+    }
+    for (int b = 0; b < DIR_MAX_BLOCKS; b++)
     {
-        struct wfs_dentry *dentries = (struct wfs_dentry *)((char *)mapped_memory + parent_inode->blocks[i]);
-        for (int j = 0; j < (BLOCK_SIZE / sizeof(struct wfs_dentry)); j++)
+        struct wfs_dentry *dentries = dentry_block(parent_inode, b, IMAGE_READ);
+        if (!dentries)
+            continue;
+        for (int j = 0; j < DENTRIES_PER_BLOCK; j++)
         {
-            printf("Inspecting entry %d: %s num:%d\n", j, dentries[j].name, dentries[j].num);
             if (dentries[j].num == inode_num && strcmp(dentries[j].name, entry_name) == 0)
             {
-                printf("Entry found. Removing...\n");
+                dentries = dentry_block(parent_inode, b, IMAGE_WRITE);
                 dentries[j].num = 0;                   // Mark the entry as free
                 memset(dentries[j].name, 0, MAX_NAME); // Clear the name
-                return 0;                              // Success
+
+                struct dir_state *state = &dir_states[parent_inode->num];
+                state->free_hint = min(state->free_hint, b * DENTRIES_PER_BLOCK + j);
+                return 0; // Success
             }
         }
     }
@@ -663,162 +3393,221 @@ static int remove_directory_entry(struct wfs_inode *parent_inode, int inode_num,
 
 static void free_inode(int inode_num)
 {
-    printf("freeing the inode\n");
     if (inode_num < 0 || inode_num >= sb.num_inodes)
     {
         return; // Out of bounds safety check
     }
-    size_t byte_index = inode_num / 8;
-    size_t bit_index = inode_num % 8;
-    inode_bitmap[byte_index] &= ~(1 << bit_index); // Clear the bit
+    inode_generations[inode_num]++;
+    if (bitmap_clear(&groups[inode_num / inodes_per_group].inode_bits, inode_num % inodes_per_group))
+    {
+        update_counts(inode_num / inodes_per_group, 1, 0);
+    }
 }
 
-static void free_block(int block_num)
+// Frees the data block at byte offset block_ptr in the image
+static void free_block(off_t block_ptr)
 {
-    printf("freeing the block\n");
-    if (block_num < 0 || block_num >= sb.num_data_blocks)
+    long block_num = block_index(block_ptr);
+    if (block_num == -1)
     {
         return; // Out of bounds safety check
     }
-    size_t byte_index = block_num / 8;
-    size_t bit_index = block_num % 8;
-    data_bitmap[byte_index] &= ~(1 << bit_index); // Clear the bit
-
-    // Optionally clear the block data
-    memset((char *)mapped_memory + block_num, 0, BLOCK_SIZE);
+    // Clear the disk's bit first, so the block cannot be taken in memory while it still reads as used
+    struct alloc_group *group = &groups[block_num / blocks_per_group];
+    if (bitmap_clear(&group->data_bits, block_num % blocks_per_group))
+    {
+        update_counts(block_num / blocks_per_group, 0, 1);
+    }
+    bitmap_clear(&group->avail_bits, block_num % blocks_per_group);
 }
 
-static int wfs_unlink(const char *path)
+// Frees n contiguous data blocks from byte offset block_ptr, clearing their bits a group at a time
+static void free_blocks(off_t block_ptr, size_t n)
 {
-    printf("Unlinking file: %s\n", path);
-
-    // Locate the inode of the file
-    struct wfs_inode *inode = find_inode_by_path(path);
-    if (!inode)
+    while (n > 0)
     {
-        return -ENOENT; // No such file
+        long block_num = block_index(block_ptr);
+        if (block_num == -1)
+        {
+            return; // Out of bounds safety check
+        }
+        struct alloc_group *group = &groups[block_num / blocks_per_group];
+        size_t k = block_num % blocks_per_group;
+        size_t run = min(n, group->data_bits.nbits - k);
+        update_counts(block_num / blocks_per_group, 0, bitmap_clear_run(&group->data_bits, k, run));
+        bitmap_clear_run(&group->avail_bits, k, run); // After the disk's bits, as in free_block
+        block_ptr += (off_t)run * block_size;
+        n -= run;
     }
+}
 
-    // Ensure the file is not a directory
-    if (S_ISDIR(inode->mode))
+// Looks up name in parent for removal, returning it with both it and the parent locked for
+// writing; on failure replies to req and returns NULL with nothing locked
+static struct wfs_inode *find_victim(fuse_req_t req, fuse_ino_t parent, const char *name, struct wfs_inode **parent_inode)
+{
+    *parent_inode = inode_lock(parent, true);
+    if (!*parent_inode)
     {
-        return -EISDIR; // Is a directory, not a file
+        fuse_reply_err(req, ENOENT); // Parent directory does not exist
+        return NULL;
     }
-
-    // Find the parent directory and the name of the file in the path
-    char *parent_path = strdup(path);
-    char *file_name = strrchr(parent_path, '/');
-    if (file_name == NULL)
+    if (!S_ISDIR((*parent_inode)->mode))
+    {
+        inode_unlock((*parent_inode)->num);
+        fuse_reply_err(req, ENOTDIR);
+        return NULL;
+    }
+    int num = lookup_dentry(*parent_inode, name);
+    if (num == -1)
     {
-        free(parent_path);
-        return -ENOENT; // Path error
+        inode_unlock((*parent_inode)->num);
+        fuse_reply_err(req, ENOENT); // No such entry
+        return NULL;
     }
-    *file_name = '\0'; // Null-terminate the parent path
-    file_name++;       // Move past the slash to the file name
+    pthread_rwlock_wrlock(&inode_locks[num]);
+    return inode_at(num);
+}
 
-    printf("Parent path: %s\n", parent_path);
-    printf("File name: %s\n", file_name);
+// Unlocks what find_victim locked and replies to req with ret
+static void victim_done(fuse_req_t req, struct wfs_inode *parent_inode, int num, int ret)
+{
+    inode_unlock(num);
+    inode_unlock(parent_inode->num);
+    fuse_reply_err(req, -ret);
+}
 
-    struct wfs_inode *parent_inode = find_inode_by_path(parent_path);
-    // free(parent_path);
-    if (!parent_inode)
+// Frees an inode that is no longer linked or open, along with its blocks
+static void release_inode(struct wfs_inode *inode)
+{
+    if (inode->flags & WFS_INODE_EXTENTS)
     {
-        return -ENOENT; // Parent directory does not exist
+        extent_free(extent_root(inode));
     }
-    printf("File name: %s\n", file_name);
-    // Remove the directory entry from the parent directory
-    int result = remove_directory_entry(parent_inode, inode->num, file_name);
-    if (result != 0)
+    else
     {
-        return result; // Failed to remove directory entry
+        release_blockmap(inode);
     }
-
-    // Free the inode and its blocks
+    // Only now may the slot be handed out again and overwritten
     free_inode(inode->num);
-    for (int i = 0; i < N_BLOCKS; i++)
+}
+
+// Frees the blocks of an inode that maps them through its block pointers
+static void release_blockmap(struct wfs_inode *inode)
+{
+    if (inode->blocks[IND_BLOCK] != 0)
+    {
+        blockmap_free(inode->blocks[IND_BLOCK], 1);
+    }
+    if (inode->blocks[DIND_BLOCK] != 0)
+    {
+        blockmap_free(inode->blocks[DIND_BLOCK], 2);
+    }
+    if (inode->tind != 0)
+    {
+        blockmap_free(inode->tind, 3);
+    }
+    for (int i = 0; i < D_BLOCK; i++)
     {
         if (inode->blocks[i] != 0)
         {
             free_block(inode->blocks[i]);
         }
     }
-
-    return 0; // Success
 }
 
-static int wfs_rmdir(const char *path)
+// Unlinks inode from its parent and releases it unless it is still open
+static int remove_inode(struct wfs_inode *parent_inode, struct wfs_inode *inode, const char *name)
 {
-    printf("Removing directory: %s\n", path);
-
-    // Locate the inode of the directory
-    struct wfs_inode *dir_inode = find_inode_by_path(path);
-    if (!dir_inode)
+    int result = remove_directory_entry(parent_inode, inode->num, name);
+    if (result != 0)
     {
-        return -ENOENT; // No such directory
+        return result; // Failed to remove directory entry
     }
 
-    // Ensure the inode is a directory
-    if (!S_ISDIR(dir_inode->mode))
+    // Drop the cached lookup before the inode number can be reused
+    dcache_remove(parent_inode->num, name);
+
+    // An open file keeps its inode and blocks until the last handle is released
+    struct open_file *of = open_files[inode->num];
+    if (of)
     {
-        return -ENOTDIR; // Not a directory
+        of->unlinked = true;
+        return 0;
     }
+    release_inode(inode);
+    return 0;
+}
 
-    // Check if directory is empty except for "." and ".."
-    bool is_empty = true;
-    for (int i = 0; i < N_BLOCKS && dir_inode->blocks[i] != 0; i++)
+static void wfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    // Locate the inode of the file
+    struct wfs_inode *parent_inode;
+    struct wfs_inode *inode = find_victim(req, parent, name, &parent_inode);
+    if (!inode)
     {
-        struct wfs_dentry *dentries = (struct wfs_dentry *)((char *)mapped_memory + dir_inode->blocks[i]);
-        for (int j = 0; j < (BLOCK_SIZE / sizeof(struct wfs_dentry)); j++)
-        {
-            if (dentries[j].num != 0 && strcmp(dentries[j].name, ".") != 0 && strcmp(dentries[j].name, "..") != 0)
-            {
-                is_empty = false;
-                break;
-            }
-        }
-        if (!is_empty)
-            break;
+        return;
     }
 
-    if (!is_empty)
+    // Ensure the file is not a directory
+    int num = inode->num;
+    if (S_ISDIR(inode->mode))
     {
-        return -ENOTEMPTY; // Directory not empty
+        victim_done(req, parent_inode, num, -EISDIR); // Is a directory, not a file
+        return;
     }
 
-    // Find the parent directory and remove the directory entry
-    char *parent_path = strdup(path);
-    char *last_slash = strrchr(parent_path, '/');
-    if (last_slash == NULL || parent_path == last_slash)
+    victim_done(req, parent_inode, num, remove_inode(parent_inode, inode, name));
+}
+
+static void wfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    // Locate the inode of the directory
+    struct wfs_inode *parent_inode;
+    struct wfs_inode *dir_inode = find_victim(req, parent, name, &parent_inode);
+    if (!dir_inode)
     {
-        free(parent_path);
-        return -EIO; // I/O error
+        return;
     }
-    *last_slash = '\0';
-    struct wfs_inode *parent_inode = find_inode_by_path(parent_path);
-    free(parent_path);
 
-    if (!parent_inode)
+    // Ensure the inode is a directory
+    int num = dir_inode->num;
+    if (!S_ISDIR(dir_inode->mode))
     {
-        return -ENOENT; // Parent directory does not exist
+        victim_done(req, parent_inode, num, -ENOTDIR); // Not a directory
+        return;
     }
 
-    // Remove the directory entry
-    char *dir_name = last_slash + 1;
-    int ret = remove_directory_entry(parent_inode, dir_inode->num, dir_name);
-    if (ret != 0)
+    // Check if directory is empty except for "." and ".."
+    bool is_empty = true;
+    if (dir_inode->flags & WFS_INODE_DIR_INDEX)
     {
-        return ret; // Failed to remove directory entry
+        is_empty = dir_inode->size == 0; // Hashed directories keep an entry count
     }
-
-    // Free the inode and its blocks
-    free_inode(dir_inode->num);
-    for (int i = 0; i < N_BLOCKS; i++)
+    else
     {
-        if (dir_inode->blocks[i] != 0)
+        for (int b = 0; b < DIR_MAX_BLOCKS; b++)
         {
-            free_block(dir_inode->blocks[i]);
+            struct wfs_dentry *dentries = dentry_block(dir_inode, b, IMAGE_READ);
+            if (!dentries)
+                continue;
+            for (int j = 0; j < DENTRIES_PER_BLOCK; j++)
+            {
+                if (dentries[j].num != 0 && strcmp(dentries[j].name, ".") != 0 && strcmp(dentries[j].name, "..") != 0)
+                {
+                    is_empty = false;
+                    break;
+                }
+            }
+            if (!is_empty)
+                break;
         }
     }
 
-    return 0; // Success
+    if (!is_empty)
+    {
+        victim_done(req, parent_inode, num, -ENOTEMPTY); // Directory not empty
+        return;
+    }
+
+    victim_done(req, parent_inode, num, remove_inode(parent_inode, dir_inode, name));
 }
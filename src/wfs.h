@@ -1,12 +1,17 @@
 #include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 #define FUSE_USE_VERSION 30
 
-#define BLOCK_SIZE (512)
+#define BLOCK_SIZE (512) /* Block size of images that do not record one */
+#define MIN_BLOCK_SIZE (512)
+#define MAX_BLOCK_SIZE (65536)
 #define MAX_NAME   (28)
 
 #define D_BLOCK    (6)
+#define DIND_BLOCK (D_BLOCK)   /* Double-indirect pointer, in the slot that older wfs left unused */
 #define IND_BLOCK  (D_BLOCK+1)
 #define N_BLOCKS   (IND_BLOCK+1)
 
@@ -24,8 +29,39 @@
 0    ^                   ^
 i_bitmap_ptr        i_blocks_ptr
 
+  With WFS_FEATURE_GROUPS the inodes and data blocks are instead split
+  into allocation groups, each laid out like the image above minus the
+  superblock. A table of group descriptors follows the superblock, and
+  the superblock's own pointers describe group 0:
+
++----+-----+---------+---------+--------+-------------+---------+---
+| SB | GDT | IBITMAP | DBITMAP | INODES | DATA BLOCKS | IBITMAP | ...
++----+-----+---------+---------+--------+-------------+---------+---
+             \_____________ group 0 ______________/    \__ group 1
+
+  Inode n is slot n % inodes_per_group of group n / inodes_per_group, and
+  data blocks are numbered across groups the same way with
+  blocks_per_group. Every group has the full count of inodes; the last
+  may have fewer data blocks.
 */
 
+/*
+  Images that use any optional feature carry an extended superblock: the
+  fields after d_blocks_ptr are only present when i_bitmap_ptr leaves room
+  for them and magic matches. Images without it behave as if every feature
+  bit were clear.
+*/
+#define WFS_MAGIC (0x5746535355504552UL)
+
+#define WFS_FEATURE_DIR_INDEX (1UL << 0) /* New directories use a hashed dentry table */
+#define WFS_FEATURE_EXTENTS   (1UL << 1) /* New files map their data with extents */
+#define WFS_FEATURE_BLOCK_SIZE (1UL << 2) /* block_size is set and the inode and data regions are page aligned */
+#define WFS_FEATURE_INLINE_DATA (1UL << 3) /* New files keep their data in the inode slot while it fits */
+#define WFS_FEATURE_INODE_SIZE (1UL << 4) /* Inode slots are inode_size bytes rather than a block each */
+#define WFS_FEATURE_GROUPS (1UL << 5) /* Inodes and data blocks are split into allocation groups */
+#define WFS_FEATURES_SUPPORTED (WFS_FEATURE_DIR_INDEX | WFS_FEATURE_EXTENTS | WFS_FEATURE_BLOCK_SIZE | \
+                                WFS_FEATURE_INLINE_DATA | WFS_FEATURE_INODE_SIZE | WFS_FEATURE_GROUPS)
+
 // Superblock
 struct wfs_sb {
     size_t num_inodes;
@@ -34,8 +70,47 @@ struct wfs_sb {
     off_t d_bitmap_ptr;
     off_t i_blocks_ptr;
     off_t d_blocks_ptr;
+
+    /* Extended superblock */
+    size_t magic;     /* WFS_MAGIC */
+    size_t features;  /* WFS_FEATURE_* flags */
+    size_t block_size; /* Bytes per block, with WFS_FEATURE_BLOCK_SIZE only */
+    size_t inode_size; /* Bytes per inode slot, a power of two, with WFS_FEATURE_INODE_SIZE only */
+
+    /* With WFS_FEATURE_GROUPS only */
+    size_t num_groups;
+    size_t inodes_per_group; /* A multiple of 8, so group bitmaps start on a byte */
+    size_t blocks_per_group; /* Likewise */
+    off_t gd_ptr;            /* Byte offset of the group descriptor table */
+
+    /* Free inodes and data blocks, kept current by wfs and checked against the bitmaps at mount */
+    size_t free_inodes;
+    size_t free_blocks;
+
+    /* Data blocks from this index on have not been allocated since mkfs zeroed them; unused with groups */
+    size_t fresh_from;
+};
+
+// Group descriptor: where one allocation group's regions start
+struct wfs_group_desc {
+    off_t i_bitmap_ptr;
+    off_t d_bitmap_ptr;
+    off_t i_blocks_ptr;
+    off_t d_blocks_ptr;
+    size_t free_inodes; /* The group's share of the superblock counts */
+    size_t free_blocks;
+    size_t fresh_from;  /* As in the superblock, counted within the group */
 };
 
+#define WFS_SB_LEGACY_SIZE (offsetof(struct wfs_sb, magic))
+#define WFS_SB_HAS(sb, field) ((sb)->i_bitmap_ptr >= (off_t)(offsetof(struct wfs_sb, field) + sizeof((sb)->field)))
+
+/* Inode flags */
+#define WFS_INODE_DIR_INDEX (1 << 0) /* Dentries live in a hashed table, see wfs.c */
+#define WFS_INODE_EXTENTS   (1 << 1) /* blocks[] holds the root of an extent tree */
+#define WFS_INODE_INLINE_DATA (1 << 2) /* Data follows the inode in its slot; blocks[] is unused */
+#define WFS_INODE_BLOCK_COUNT (1 << 3) /* nblocks is kept current */
+
 // Inode
 struct wfs_inode {
     int     num;      /* Inode number */
@@ -50,6 +125,10 @@ struct wfs_inode {
     time_t ctim;      /* Time of last status change */
 
     off_t blocks[N_BLOCKS];
+
+    int     flags;    /* WFS_INODE_* flags, zero on legacy images */
+    uint32_t nblocks; /* Data blocks allocated, holes excluded; fills what was padding */
+    off_t   tind;     /* Triple-indirect block, zero on legacy images */
 };
 
 // Directory entry
@@ -57,3 +136,27 @@ struct wfs_dentry {
     char name[MAX_NAME];
     int num;
 };
+
+/*
+  Extent tree. An inode with WFS_INODE_EXTENTS stores the root node in
+  place of blocks[]; deeper nodes fill a data block each. Every node is a
+  header followed by records sorted by lblock. In a leaf (depth 0) a
+  record maps `len` logical blocks starting at `lblock` to physically
+  contiguous blocks starting at byte offset `start`. In an index node a
+  record points at the child node at `start`, which holds every extent
+  from `lblock` up to the next record's `lblock` (`len` is unused).
+*/
+#define WFS_EXTENT_MAGIC (0xE57E)
+
+struct wfs_extent_header {
+    uint16_t magic;   /* WFS_EXTENT_MAGIC */
+    uint16_t entries; /* Records in use */
+    uint16_t max;     /* Records that fit in this node */
+    uint16_t depth;   /* 0 for a leaf, else the number of index levels below */
+};
+
+struct wfs_extent {
+    uint32_t lblock;  /* First logical block covered */
+    uint32_t len;     /* Number of blocks, leaves only */
+    off_t    start;   /* Byte offset of the first data block, or of the child node */
+};
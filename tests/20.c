@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int item_num = 300;
+
+int main() {
+  int ret;
+
+  {
+    MAP_DISK();
+    CHECK_FEATURE(WFS_FEATURE_DIR_INDEX);
+    UNMAP_DISK();
+  }
+
+  char** filenames = (char**)calloc(item_num, sizeof(char*));
+  for (size_t i = 0; i < item_num; i++) {
+    filenames[i] = (char*)calloc(32, sizeof(char));
+    sprintf(filenames[i], "file%ld", i);
+  }
+
+  CHECK(create_dir("mnt/hashed"));
+
+  printf("Creating %d files\n", item_num);
+
+  char filename[64];
+  for (int i = 0; i < item_num; i++) {
+    sprintf(filename, "mnt/hashed/%s", filenames[i]);
+    CHECK(create_file(filename));
+    CHECK(close_file(ret));
+  }
+
+  printf("Looking up every file\n");
+
+  struct stat st;
+  for (int i = 0; i < item_num; i++) {
+    sprintf(filename, "mnt/hashed/%s", filenames[i]);
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+      printf("Failed to look up %s\n", filename);
+      return FAIL;
+    }
+  }
+  if (stat("mnt/hashed/file300", &st) == 0 || errno != ENOENT) {
+    printf("Found a file that was never created\n");
+    return FAIL;
+  }
+
+  CHECK(read_dir_check("mnt/hashed", filenames, item_num));
+
+  printf("Removing every other file\n");
+
+  char** remaining = (char**)calloc(item_num / 2, sizeof(char*));
+  for (int i = 0; i < item_num; i++) {
+    sprintf(filename, "mnt/hashed/%s", filenames[i]);
+    if (i % 2 == 0) {
+      CHECK(remove_file(filename));
+    } else {
+      remaining[i / 2] = filenames[i];
+    }
+  }
+
+  CHECK(read_dir_check("mnt/hashed", remaining, item_num / 2));
+
+  for (int i = 0; i < item_num; i++) {
+    sprintf(filename, "mnt/hashed/%s", filenames[i]);
+    if ((stat(filename, &st) == 0) != (i % 2 == 1)) {
+      printf("Wrong lookup result for %s after removal\n", filename);
+      return FAIL;
+    }
+  }
+
+  printf("Removing the rest\n");
+
+  for (int i = 1; i < item_num; i += 2) {
+    sprintf(filename, "mnt/hashed/%s", filenames[i]);
+    CHECK(remove_file(filename));
+  }
+
+  CHECK(read_dir_check("mnt/hashed", NULL, 0));
+  CHECK(remove_dir("mnt/hashed"));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
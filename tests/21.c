@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int file_block_num = 300;
+const int chunk_block_num = 16;
+
+// One extent in the inode maps the whole file, so there is no indirect block
+const int expected_inode_count = 2;
+const int expected_data_block_count = 1 + file_block_num;
+
+int main() {
+  int ret;
+
+  {
+    MAP_DISK();
+    CHECK_FEATURE(WFS_FEATURE_EXTENTS);
+    UNMAP_DISK();
+  }
+
+  int filesize = file_block_num * BLOCK_SIZE;
+  int chunksize = chunk_block_num * BLOCK_SIZE;
+  char* buf = (char*)malloc(filesize);
+  generate_random_data(buf, filesize);
+
+  CHECK(create_file("mnt/extents.txt"));
+  int fd = ret;
+
+  printf("Writing %d blocks\n", file_block_num);
+
+  for (int off = 0; off < filesize; off += chunksize) {
+    int len = filesize - off < chunksize ? filesize - off : chunksize;
+    CHECK(write_file_check(fd, buf + off, len, "mnt/extents.txt", off));
+  }
+
+  CHECK(close_file(fd));
+
+  struct stat st;
+  if (stat("mnt/extents.txt", &st) != 0 || st.st_size != filesize ||
+      st.st_blocks != file_block_num) {
+    printf("Wrong size or block count after writing\n");
+    return FAIL;
+  }
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, expected_data_block_count);
+    UNMAP_DISK();
+  }
+
+  printf("Reading back\n");
+
+  CHECK(open_file_read("mnt/extents.txt"));
+  fd = ret;
+
+  for (int off = 0; off < filesize; off += chunksize) {
+    int len = filesize - off < chunksize ? filesize - off : chunksize;
+    CHECK(read_file_check(fd, buf + off, len, "mnt/extents.txt", off));
+  }
+
+  CHECK(close_file(fd));
+
+  CHECK(remove_file("mnt/extents.txt"));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/statvfs.h>
+#include "common/test.h"
+
+const size_t block_size = 4096;
+const int filesize = 10000; // Three blocks, the last partly used
+
+const int expected_inode_count = 2;
+const int expected_data_block_count = 4;
+
+int main() {
+  int ret;
+
+  {
+    MAP_DISK();
+    CHECK_FEATURE(WFS_FEATURE_BLOCK_SIZE);
+    struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+    size_t align = block_size > sysconf(_SC_PAGESIZE) ? block_size : sysconf(_SC_PAGESIZE);
+    if (sb->block_size != block_size || sb->i_blocks_ptr % align != 0 ||
+        sb->d_blocks_ptr % align != 0) {
+      printf("Wrong block size or unaligned regions: block size %ld, inodes at %ld, data at %ld\n",
+             sb->block_size, sb->i_blocks_ptr, sb->d_blocks_ptr);
+      UNMAP_DISK();
+      return FAIL;
+    }
+    UNMAP_DISK();
+  }
+
+  struct statvfs stv;
+  if (statvfs("mnt", &stv) != 0 || stv.f_bsize != block_size ||
+      stv.f_frsize != block_size) {
+    printf("statvfs does not report %ld-byte blocks\n", block_size);
+    return FAIL;
+  }
+
+  char* buf = (char*)malloc(filesize);
+  generate_random_data(buf, filesize);
+
+  CHECK(create_file("mnt/big_blocks.txt"));
+  int fd = ret;
+
+  CHECK(write_file_check(fd, buf, filesize, "mnt/big_blocks.txt", 0));
+
+  CHECK(close_file(fd));
+
+  struct stat st;
+  if (stat("mnt/big_blocks.txt", &st) != 0 || st.st_size != filesize ||
+      st.st_blocks != 3 * block_size / 512) {
+    printf("Wrong size or block count after writing\n");
+    return FAIL;
+  }
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, expected_data_block_count);
+    UNMAP_DISK();
+  }
+
+  CHECK(open_file_read("mnt/big_blocks.txt"));
+  fd = ret;
+
+  CHECK(read_file_check(fd, buf, filesize, "mnt/big_blocks.txt", 0));
+
+  CHECK(close_file(fd));
+
+  CHECK(remove_file("mnt/big_blocks.txt"));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int small_size = 300;  // Fits in the inode slot
+const int large_size = 2000; // Four blocks
+
+static int check_blocks(const char* path, off_t expected_size, blkcnt_t expected_blocks) {
+  struct stat st;
+  if (stat(path, &st) != 0 || st.st_size != expected_size ||
+      st.st_blocks != expected_blocks) {
+    printf("%s: expected size %ld and %ld blocks\n", path, expected_size,
+           expected_blocks);
+    return FAIL;
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+
+  {
+    MAP_DISK();
+    CHECK_FEATURE(WFS_FEATURE_INLINE_DATA);
+    UNMAP_DISK();
+  }
+
+  char* buf = (char*)malloc(large_size);
+  generate_random_data(buf, large_size);
+
+  CHECK(create_file("mnt/inline.txt"));
+  int fd = ret;
+
+  printf("Writing %d bytes in two parts\n", small_size);
+
+  CHECK(write_file_check(fd, buf, 100, "mnt/inline.txt", 0));
+  CHECK(write_file_check(fd, buf + 100, small_size - 100, "mnt/inline.txt", 100));
+  CHECK(check_blocks("mnt/inline.txt", small_size, 0));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(2, 1); // Only the root directory's block
+    UNMAP_DISK();
+  }
+
+  CHECK(close_file(fd));
+
+  CHECK(open_file_read("mnt/inline.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, small_size, "mnt/inline.txt", 0));
+  CHECK(close_file(fd));
+
+  printf("Growing it to %d bytes\n", large_size);
+
+  CHECK(open_file_write("mnt/inline.txt"));
+  fd = ret;
+  CHECK(write_file_check(fd, buf + small_size, large_size - small_size,
+                         "mnt/inline.txt", small_size));
+  CHECK(close_file(fd));
+  CHECK(check_blocks("mnt/inline.txt", large_size, 4));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(2, 5);
+    UNMAP_DISK();
+  }
+
+  CHECK(open_file_read("mnt/inline.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, large_size, "mnt/inline.txt", 0));
+  CHECK(close_file(fd));
+
+  CHECK(remove_file("mnt/inline.txt"));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const size_t inode_size = 256;
+const int item_num = 64;
+const int filesize = 100;
+
+// The root directory holds 64 dentries in four blocks, and each file has one block
+const int expected_inode_count = 1 + item_num;
+const int expected_data_block_count = 4 + item_num;
+
+int main() {
+  int ret;
+
+  {
+    MAP_DISK();
+    CHECK_FEATURE(WFS_FEATURE_INODE_SIZE);
+    struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+    if (sb->inode_size != inode_size ||
+        sb->d_blocks_ptr - sb->i_blocks_ptr >= sb->num_inodes * BLOCK_SIZE) {
+      printf("Inode slots are not %ld bytes\n", inode_size);
+      UNMAP_DISK();
+      return FAIL;
+    }
+    UNMAP_DISK();
+  }
+
+  // Neighbouring inodes share a block, so each file gets contents of its own
+  char* buf = (char*)malloc(item_num * filesize);
+  generate_random_data(buf, item_num * filesize);
+
+  printf("Creating %d files\n", item_num);
+
+  char filename[32];
+  for (int i = 0; i < item_num; i++) {
+    sprintf(filename, "mnt/file%d", i);
+    CHECK(create_file(filename));
+    int fd = ret;
+    CHECK(write_file_check(fd, buf + i * filesize, filesize, filename, 0));
+    CHECK(close_file(fd));
+  }
+
+  printf("Checking every file\n");
+
+  for (int i = 0; i < item_num; i++) {
+    sprintf(filename, "mnt/file%d", i);
+    struct stat st;
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size != filesize) {
+      printf("Wrong attributes for %s\n", filename);
+      return FAIL;
+    }
+    CHECK(open_file_read(filename));
+    int fd = ret;
+    CHECK(read_file_check(fd, buf + i * filesize, filesize, filename, 0));
+    CHECK(close_file(fd));
+  }
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, expected_data_block_count);
+  UNMAP_DISK();
+
+  return PASS;
+}
@@ -0,0 +1,70 @@
+#define _GNU_SOURCE // For SEEK_DATA and SEEK_HOLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+// Blocks 0 and 1 hold data, 2 to 9 are a hole and 10 holds data again
+const int filesize = 11 * BLOCK_SIZE;
+
+// Block 10 is past the direct pointers, so the file also has its indirect block
+const int expected_inode_count = 2;
+const int expected_data_block_count = 5;
+
+static int check_seek(int fd, off_t offset, int whence, off_t expected) {
+  off_t found = lseek(fd, offset, whence);
+  if (found != expected) {
+    printf("lseek(%ld, %s) returned %ld, expected %ld\n", offset,
+           whence == SEEK_DATA ? "SEEK_DATA" : "SEEK_HOLE", found, expected);
+    return FAIL;
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  char* buf = (char*)malloc(filesize);
+  generate_random_data(buf, filesize);
+  memset(buf + 2 * BLOCK_SIZE, 0, 8 * BLOCK_SIZE);
+
+  CHECK(create_file("mnt/sparse.txt"));
+  int fd = ret;
+
+  CHECK(write_file_check(fd, buf, 2 * BLOCK_SIZE, "mnt/sparse.txt", 0));
+  CHECK(write_file_check(fd, buf + 10 * BLOCK_SIZE, BLOCK_SIZE, "mnt/sparse.txt",
+                         10 * BLOCK_SIZE));
+  CHECK(close_file(fd));
+
+  struct stat st;
+  if (stat("mnt/sparse.txt", &st) != 0 || st.st_size != filesize ||
+      st.st_blocks != 3) {
+    printf("Wrong size or block count for a sparse file\n");
+    return FAIL;
+  }
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, expected_data_block_count);
+  UNMAP_DISK();
+
+  CHECK(open_file_read("mnt/sparse.txt"));
+  fd = ret;
+
+  CHECK(read_file_check(fd, buf, filesize, "mnt/sparse.txt", 0));
+
+  CHECK(check_seek(fd, 0, SEEK_DATA, 0));
+  CHECK(check_seek(fd, 100, SEEK_HOLE, 2 * BLOCK_SIZE));
+  CHECK(check_seek(fd, 2 * BLOCK_SIZE, SEEK_HOLE, 2 * BLOCK_SIZE));
+  CHECK(check_seek(fd, 3 * BLOCK_SIZE, SEEK_DATA, 10 * BLOCK_SIZE));
+  CHECK(check_seek(fd, 10 * BLOCK_SIZE + 5, SEEK_DATA, 10 * BLOCK_SIZE + 5));
+  CHECK(check_seek(fd, 10 * BLOCK_SIZE, SEEK_HOLE, filesize));
+
+  if (lseek(fd, filesize, SEEK_DATA) != -1 || errno != ENXIO) {
+    printf("SEEK_DATA at the end of the file did not fail with ENXIO\n");
+    return FAIL;
+  }
+
+  CHECK(close_file(fd));
+
+  return PASS;
+}
@@ -0,0 +1,91 @@
+#define _GNU_SOURCE // For fallocate
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int expected_inode_count = 2;
+
+static int check_blocks(const char* path, off_t expected_size, blkcnt_t expected_blocks) {
+  struct stat st;
+  if (stat(path, &st) != 0 || st.st_size != expected_size ||
+      st.st_blocks != expected_blocks) {
+    printf("%s: expected size %ld and %ld blocks\n", path, expected_size,
+           expected_blocks);
+    return FAIL;
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  int filesize = 8 * BLOCK_SIZE;
+  char* buf = (char*)calloc(1, filesize);
+
+  CHECK(create_file("mnt/falloc.txt"));
+  int fd = ret;
+
+  printf("Allocating %d blocks\n", 8);
+
+  if (fallocate(fd, 0, 0, filesize) != 0) {
+    perror("fallocate");
+    return FAIL;
+  }
+  CHECK(check_blocks("mnt/falloc.txt", filesize, 8));
+
+  // The root directory's block and the file's indirect block come on top of its data blocks
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, 1 + 8 + 1);
+    UNMAP_DISK();
+  }
+
+  printf("Allocating %d more blocks past the end, keeping the size\n", 4);
+
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, filesize, 4 * BLOCK_SIZE) != 0) {
+    perror("fallocate");
+    return FAIL;
+  }
+  CHECK(check_blocks("mnt/falloc.txt", filesize, 12));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, 1 + 12 + 1);
+    UNMAP_DISK();
+  }
+
+  printf("Writing the allocated blocks and punching a hole in them\n");
+
+  generate_random_data(buf, filesize);
+  CHECK(write_file_check(fd, buf, filesize, "mnt/falloc.txt", 0));
+
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, BLOCK_SIZE,
+                3 * BLOCK_SIZE) != 0) {
+    perror("fallocate");
+    return FAIL;
+  }
+  memset(buf + BLOCK_SIZE, 0, 3 * BLOCK_SIZE);
+  CHECK(check_blocks("mnt/falloc.txt", filesize, 9));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, 1 + 9 + 1);
+    UNMAP_DISK();
+  }
+
+  CHECK(close_file(fd));
+
+  CHECK(open_file_read("mnt/falloc.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, filesize, "mnt/falloc.txt", 0));
+  CHECK(close_file(fd));
+
+  CHECK(remove_file("mnt/falloc.txt"));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
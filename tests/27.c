@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/statvfs.h>
+#include "common/test.h"
+
+const int dir_num = 3;
+const int file_num = 4; // In each directory
+const int file_block_num = 2;
+
+// The root, the directories and the files; the root and each directory have one block of dentries
+const int expected_inode_count = 1 + dir_num + dir_num * file_num;
+const int expected_data_block_count = 1 + dir_num + dir_num * file_num * file_block_num;
+
+// Counts the inodes and data blocks in use across every group
+static void group_counts(char* disk_map, size_t* inodes, size_t* blocks) {
+  struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+  struct wfs_group_desc* gdt = (struct wfs_group_desc*)(disk_map + sb->gd_ptr);
+  *inodes = 0;
+  *blocks = 0;
+  for (size_t g = 0; g < sb->num_groups; g++) {
+    // The last group may have fewer data blocks
+    size_t group_blocks = g < sb->num_groups - 1 ? sb->blocks_per_group
+                                                 : sb->num_data_blocks - g * sb->blocks_per_group;
+    *inodes += bitmap_count(disk_map + gdt[g].i_bitmap_ptr, sb->inodes_per_group / 8);
+    *blocks += bitmap_count(disk_map + gdt[g].d_bitmap_ptr, group_blocks / 8);
+  }
+}
+
+static int check_counts(size_t expected_inodes, size_t expected_blocks) {
+  MAP_DISK();
+  size_t inodes, blocks;
+  group_counts(disk_map, &inodes, &blocks);
+  UNMAP_DISK();
+  if (inodes != expected_inodes || blocks != expected_blocks) {
+    printf("Wrong counts: expected %ld inodes and %ld data blocks, found %ld and %ld\n",
+           expected_inodes, expected_blocks, inodes, blocks);
+    return FAIL;
+  }
+
+  struct statvfs stv;
+  if (statvfs("mnt", &stv) != 0 || stv.f_files - stv.f_ffree != expected_inodes ||
+      stv.f_blocks - stv.f_bfree != expected_blocks) {
+    printf("statvfs does not agree with the bitmaps\n");
+    return FAIL;
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  size_t inodes_per_group;
+
+  {
+    MAP_DISK();
+    CHECK_FEATURE(WFS_FEATURE_GROUPS);
+    struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+    inodes_per_group = sb->inodes_per_group;
+    if (sb->num_groups < dir_num) {
+      printf("Expected at least %d groups, found %ld\n", dir_num, sb->num_groups);
+      UNMAP_DISK();
+      return FAIL;
+    }
+    UNMAP_DISK();
+  }
+
+  int filesize = file_block_num * BLOCK_SIZE;
+  char* buf = (char*)malloc(dir_num * file_num * filesize);
+  generate_random_data(buf, dir_num * file_num * filesize);
+
+  printf("Creating %d directories of %d files\n", dir_num, file_num);
+
+  char path[64];
+  size_t dir_groups[dir_num];
+  for (int d = 0; d < dir_num; d++) {
+    sprintf(path, "mnt/dir%d", d);
+    CHECK(create_dir(path));
+
+    // New directories go to the emptiest group, so each of these gets a group of its own
+    struct stat st;
+    if (stat(path, &st) != 0) {
+      printf("Unable to stat %s\n", path);
+      return FAIL;
+    }
+    dir_groups[d] = (st.st_ino - 1) / inodes_per_group;
+    for (int other = 0; other < d; other++) {
+      if (dir_groups[d] == dir_groups[other]) {
+        printf("%s shares a group with dir%d\n", path, other);
+        return FAIL;
+      }
+    }
+
+    for (int f = 0; f < file_num; f++) {
+      sprintf(path, "mnt/dir%d/file%d", d, f);
+      CHECK(create_file(path));
+      int fd = ret;
+      CHECK(write_file_check(fd, buf + (d * file_num + f) * filesize, filesize, path, 0));
+      CHECK(close_file(fd));
+
+      // Files take inodes from their directory's group
+      if (stat(path, &st) != 0 || (st.st_ino - 1) / inodes_per_group != dir_groups[d]) {
+        printf("%s is not in its directory's group\n", path);
+        return FAIL;
+      }
+    }
+  }
+
+  CHECK(check_counts(expected_inode_count, expected_data_block_count));
+
+  printf("Reading back and removing everything\n");
+
+  for (int d = 0; d < dir_num; d++) {
+    for (int f = 0; f < file_num; f++) {
+      sprintf(path, "mnt/dir%d/file%d", d, f);
+      CHECK(open_file_read(path));
+      int fd = ret;
+      CHECK(read_file_check(fd, buf + (d * file_num + f) * filesize, filesize, path, 0));
+      CHECK(close_file(fd));
+      CHECK(remove_file(path));
+    }
+    sprintf(path, "mnt/dir%d", d);
+    CHECK(remove_dir(path));
+  }
+
+  CHECK(check_counts(1, 1));
+
+  return PASS;
+}
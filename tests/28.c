@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int file_block_num = 20;
+const int short_size = 3 * BLOCK_SIZE + 100;
+const int long_size = 40 * BLOCK_SIZE;
+
+const int expected_inode_count = 2;
+
+static int check_blocks(const char* path, off_t expected_size, blkcnt_t expected_blocks) {
+  struct stat st;
+  if (stat(path, &st) != 0 || st.st_size != expected_size ||
+      st.st_blocks != expected_blocks) {
+    printf("%s: expected size %ld and %ld blocks\n", path, expected_size,
+           expected_blocks);
+    return FAIL;
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  int filesize = file_block_num * BLOCK_SIZE;
+  char* buf = (char*)malloc(long_size);
+  generate_random_data(buf, filesize);
+
+  CHECK(create_file("mnt/trunc.txt"));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, filesize, "mnt/trunc.txt", 0));
+  CHECK(close_file(fd));
+
+  // The root directory's block and the file's indirect block come on top of its data blocks
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, 1 + file_block_num + 1);
+    UNMAP_DISK();
+  }
+
+  printf("Truncating to %d bytes\n", short_size);
+
+  if (truncate("mnt/trunc.txt", short_size) != 0) {
+    perror("truncate");
+    return FAIL;
+  }
+  CHECK(check_blocks("mnt/trunc.txt", short_size, 4));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, 1 + 4);
+    UNMAP_DISK();
+  }
+
+  printf("Extending to %d bytes\n", long_size);
+
+  // What was cut off must read back as zeros, including the rest of the last block
+  if (truncate("mnt/trunc.txt", long_size) != 0) {
+    perror("truncate");
+    return FAIL;
+  }
+  memset(buf + short_size, 0, long_size - short_size);
+  CHECK(check_blocks("mnt/trunc.txt", long_size, 4));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, 1 + 4);
+    UNMAP_DISK();
+  }
+
+  CHECK(open_file_read("mnt/trunc.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, long_size, "mnt/trunc.txt", 0));
+  CHECK(close_file(fd));
+
+  printf("Truncating to zero with ftruncate\n");
+
+  CHECK(open_file_write("mnt/trunc.txt"));
+  fd = ret;
+  if (ftruncate(fd, 0) != 0) {
+    perror("ftruncate");
+    return FAIL;
+  }
+  CHECK(close_file(fd));
+  CHECK(check_blocks("mnt/trunc.txt", 0, 0));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
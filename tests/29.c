@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/statvfs.h>
+#include "common/test.h"
+
+const int file_num = 5;
+const int file_block_num = 3;
+
+// statfs answers from the free counts, which must match the bitmaps and, on an image with the
+// extended superblock, the counts stored in it
+static int check_statfs(void) {
+  struct statvfs stv;
+  if (statvfs("mnt", &stv) != 0) {
+    perror("statvfs");
+    return FAIL;
+  }
+
+  MAP_DISK();
+  struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+  size_t free_inodes = sb->num_inodes - inode_count(disk_map);
+  size_t free_blocks = sb->num_data_blocks - data_block_count(disk_map);
+  if (stv.f_bsize != BLOCK_SIZE || stv.f_namemax != MAX_NAME - 1 ||
+      stv.f_files != sb->num_inodes || stv.f_blocks != sb->num_data_blocks) {
+    printf("statvfs does not describe the image\n");
+    UNMAP_DISK();
+    return FAIL;
+  }
+  if (stv.f_ffree != free_inodes || stv.f_bfree != free_blocks ||
+      stv.f_bavail != free_blocks) {
+    printf("statvfs reports %ld free inodes and %ld free blocks, the bitmaps %ld and %ld\n",
+           stv.f_ffree, stv.f_bfree, free_inodes, free_blocks);
+    UNMAP_DISK();
+    return FAIL;
+  }
+  if (sb->free_inodes != free_inodes || sb->free_blocks != free_blocks) {
+    printf("The superblock counts %ld free inodes and %ld free blocks\n",
+           sb->free_inodes, sb->free_blocks);
+    UNMAP_DISK();
+    return FAIL;
+  }
+  UNMAP_DISK();
+  return PASS;
+}
+
+int main() {
+  int ret;
+
+  {
+    MAP_DISK();
+    if (((struct wfs_sb*)disk_map)->magic != WFS_MAGIC) {
+      printf("Image has no extended superblock\n");
+      UNMAP_DISK();
+      return FAIL;
+    }
+    UNMAP_DISK();
+  }
+
+  CHECK(check_statfs());
+
+  int filesize = file_block_num * BLOCK_SIZE;
+  char* buf = (char*)malloc(filesize);
+  generate_random_data(buf, filesize);
+
+  printf("Creating %d files in a directory\n", file_num);
+
+  CHECK(create_dir("mnt/dir"));
+  char path[32];
+  for (int i = 0; i < file_num; i++) {
+    sprintf(path, "mnt/dir/file%d", i);
+    CHECK(create_file(path));
+    int fd = ret;
+    CHECK(write_file_check(fd, buf, filesize, path, 0));
+    CHECK(close_file(fd));
+  }
+
+  CHECK(check_statfs());
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(2 + file_num, 2 + file_num * file_block_num);
+    UNMAP_DISK();
+  }
+
+  printf("Removing them\n");
+
+  for (int i = 0; i < file_num; i++) {
+    sprintf(path, "mnt/dir/file%d", i);
+    CHECK(remove_file(path));
+  }
+  CHECK(remove_dir("mnt/dir"));
+
+  CHECK(check_statfs());
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int file_num = 3;
+const int file_block_num = 20;
+
+// The root, the directory and the files; the root's and the directory's blocks and each file's
+// indirect block come on top of the files' data blocks
+const int expected_inode_count = 2 + file_num;
+const int expected_data_block_count = 2 + file_num * (file_block_num + 1);
+
+// Unmounts the image and waits for wfs, which runs in the background, to write it back and exit
+static int unmount_and_wait(void) {
+  if (system("fusermount -u mnt") != 0) {
+    printf("Unable to unmount\n");
+    return FAIL;
+  }
+  for (int i = 0; i < 100; i++) {
+    if (system("pgrep -x wfs > /dev/null") != 0) {
+      return PASS;
+    }
+    usleep(100000);
+  }
+  printf("wfs did not exit after unmounting\n");
+  return FAIL;
+}
+
+int main() {
+  int ret;
+  int filesize = file_block_num * BLOCK_SIZE;
+  char* buf = (char*)malloc(file_num * filesize);
+  generate_random_data(buf, file_num * filesize);
+
+  printf("Writing %d files through the cache\n", file_num);
+
+  CHECK(create_dir("mnt/dir"));
+  char path[32];
+  for (int i = 0; i < file_num; i++) {
+    sprintf(path, "mnt/dir/file%d", i);
+    CHECK(create_file(path));
+    int fd = ret;
+    CHECK(write_file_check(fd, buf + i * filesize, filesize, path, 0));
+    CHECK(close_file(fd));
+  }
+
+  printf("Unmounting and checking the image\n");
+
+  // Everything the cache held must be on the image once wfs has exited
+  CHECK(unmount_and_wait());
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, expected_data_block_count);
+    UNMAP_DISK();
+  }
+
+  printf("Mounting again and reading the files back\n");
+
+  if (system("./wfs disk.img -c 16 -s mnt") != 0) {
+    printf("Unable to mount the image again\n");
+    return FAIL;
+  }
+  for (int i = 0; i < file_num; i++) {
+    sprintf(path, "mnt/dir/file%d", i);
+    CHECK(open_file_read(path));
+    int fd = ret;
+    CHECK(read_file_check(fd, buf + i * filesize, filesize, path, 0));
+    CHECK(close_file(fd));
+  }
+
+  return PASS;
+}
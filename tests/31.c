@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+// With 512-byte blocks an indirect block holds 64 pointers: the single indirect block maps
+// blocks 6 to 69, the double-indirect tree the next 64 * 64 and the triple-indirect tree the rest
+#define PTRS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(off_t))
+const int dind_start = D_BLOCK + PTRS_PER_BLOCK;
+const int tind_start = D_BLOCK + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+
+const int expected_inode_count = 2;
+
+static int check_blocks(const char* path, off_t expected_size, blkcnt_t expected_blocks) {
+  struct stat st;
+  if (stat(path, &st) != 0 || st.st_size != expected_size ||
+      st.st_blocks != expected_blocks) {
+    printf("%s: expected size %ld and %ld blocks\n", path, expected_size,
+           expected_blocks);
+    return FAIL;
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  // A run from block 0 ten blocks into the double-indirect tree, and one block a little way into
+  // the triple-indirect tree with a hole before it
+  int run_block_num = dind_start + 10;
+  int far_block = tind_start + 5;
+  int filesize = (far_block + 1) * BLOCK_SIZE;
+  char* buf = (char*)calloc(1, filesize);
+  generate_random_data(buf, run_block_num * BLOCK_SIZE);
+  generate_random_data(buf + far_block * BLOCK_SIZE, BLOCK_SIZE);
+
+  printf("Writing %d blocks, past the single indirect block, and block %d\n", run_block_num,
+         far_block);
+
+  CHECK(create_file("mnt/deep.txt"));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, run_block_num * BLOCK_SIZE, "mnt/deep.txt", 0));
+  CHECK(write_file_check(fd, buf + far_block * BLOCK_SIZE, BLOCK_SIZE, "mnt/deep.txt",
+                         far_block * BLOCK_SIZE));
+  CHECK(close_file(fd));
+  CHECK(check_blocks("mnt/deep.txt", filesize, run_block_num + 1));
+
+  // On top of the root directory's block and the data: the indirect block, the double-indirect
+  // block and one block under it, and the triple-indirect block with one block on each level below
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, 1 + (run_block_num + 1) + 1 + 2 + 3);
+    UNMAP_DISK();
+  }
+
+  CHECK(open_file_read("mnt/deep.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, filesize, "mnt/deep.txt", 0));
+  CHECK(close_file(fd));
+
+  printf("Truncating to the end of the single indirect block\n");
+
+  // Every double and triple indirect block goes with the data under them
+  if (truncate("mnt/deep.txt", dind_start * BLOCK_SIZE) != 0) {
+    perror("truncate");
+    return FAIL;
+  }
+  CHECK(check_blocks("mnt/deep.txt", dind_start * BLOCK_SIZE, dind_start));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, 1 + dind_start + 1);
+    UNMAP_DISK();
+  }
+
+  CHECK(open_file_read("mnt/deep.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, dind_start * BLOCK_SIZE, "mnt/deep.txt", 0));
+  CHECK(close_file(fd));
+
+  printf("Writing into both trees again and removing the file\n");
+
+  CHECK(open_file_write("mnt/deep.txt"));
+  fd = ret;
+  CHECK(write_file_check(fd, buf + dind_start * BLOCK_SIZE, BLOCK_SIZE, "mnt/deep.txt",
+                         dind_start * BLOCK_SIZE));
+  CHECK(write_file_check(fd, buf + far_block * BLOCK_SIZE, BLOCK_SIZE, "mnt/deep.txt",
+                         far_block * BLOCK_SIZE));
+  CHECK(close_file(fd));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, 1 + (dind_start + 2) + 1 + 2 + 3);
+    UNMAP_DISK();
+  }
+
+  CHECK(remove_file("mnt/deep.txt"));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
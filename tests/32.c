@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int file_block_num = 60;
+
+// Where logical block b of the file with inode number num lies on the image, for blocks reached
+// through the direct pointers and the single indirect block
+static off_t file_block(char* disk_map, int num, int b) {
+  struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+  struct wfs_inode* inode = (struct wfs_inode*)(disk_map + sb->i_blocks_ptr + num * BLOCK_SIZE);
+  if (b < D_BLOCK) {
+    return inode->blocks[b];
+  }
+  if (inode->blocks[IND_BLOCK] == 0) {
+    return 0;
+  }
+  return ((off_t*)(disk_map + inode->blocks[IND_BLOCK]))[b - D_BLOCK];
+}
+
+// Writes what the cache holds back to the image, so that it can be checked
+static int sync_file(int fd) {
+  if (fsync(fd) != 0) {
+    perror("fsync");
+    return FAIL;
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  int filesize = file_block_num * BLOCK_SIZE;
+  char* buf = (char*)malloc(filesize);
+  generate_random_data(buf, filesize);
+
+  // Leave data behind in the blocks the next files will be given
+  CHECK(create_file("mnt/old.txt"));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, filesize, "mnt/old.txt", 0));
+  CHECK(close_file(fd));
+  CHECK(remove_file("mnt/old.txt"));
+
+  printf("Writing %d blocks in one write\n", file_block_num);
+
+  CHECK(create_file("mnt/batch.txt"));
+  fd = ret;
+  CHECK(write_file_check(fd, buf, filesize, "mnt/batch.txt", 0));
+  CHECK(sync_file(fd));
+  CHECK(close_file(fd));
+
+  struct stat st;
+  if (stat("mnt/batch.txt", &st) != 0) {
+    perror("stat");
+    return FAIL;
+  }
+
+  // The write's blocks are allocated as one run, on top of which come the root directory's block
+  // and the file's indirect block
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(2, 1 + file_block_num + 1);
+    for (int b = 1; b < file_block_num; b++) {
+      if (file_block(disk_map, st.st_ino - 1, b) !=
+          file_block(disk_map, st.st_ino - 1, b - 1) + BLOCK_SIZE) {
+        printf("Block %d does not follow block %d on the image\n", b, b - 1);
+        UNMAP_DISK();
+        return FAIL;
+      }
+    }
+    UNMAP_DISK();
+  }
+
+  CHECK(open_file_read("mnt/batch.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, filesize, "mnt/batch.txt", 0));
+  CHECK(close_file(fd));
+
+  printf("Writing part of three blocks\n");
+
+  // What the write leaves of its first and last blocks must read as zeros, not as old data
+  int head = 100;
+  int len = 2 * BLOCK_SIZE + 50;
+  char* expected = (char*)calloc(1, head + len);
+  memcpy(expected + head, buf, len);
+
+  CHECK(create_file("mnt/partial.txt"));
+  fd = ret;
+  CHECK(write_file_check(fd, buf, len, "mnt/partial.txt", head));
+  CHECK(sync_file(fd));
+  CHECK(close_file(fd));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(3, 1 + file_block_num + 1 + 3);
+    UNMAP_DISK();
+  }
+
+  CHECK(open_file_read("mnt/partial.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, expected, head + len, "mnt/partial.txt", 0));
+  CHECK(close_file(fd));
+
+  return PASS;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int file_block_num = 30;
+
+// Each file keeps a reservation that doubles from 8 blocks while it grows sequentially, so two
+// files written a block at a time in turn each end up in a few runs rather than one per block
+const int max_runs = 4;
+
+// Where logical block b of the file with inode number num lies on the image, for blocks reached
+// through the direct pointers and the single indirect block
+static off_t file_block(char* disk_map, int num, int b) {
+  struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+  struct wfs_inode* inode = (struct wfs_inode*)(disk_map + sb->i_blocks_ptr + num * BLOCK_SIZE);
+  if (b < D_BLOCK) {
+    return inode->blocks[b];
+  }
+  if (inode->blocks[IND_BLOCK] == 0) {
+    return 0;
+  }
+  return ((off_t*)(disk_map + inode->blocks[IND_BLOCK]))[b - D_BLOCK];
+}
+
+// Counts the runs of contiguous blocks the file is stored in
+static int file_runs(char* disk_map, int num) {
+  int runs = 1;
+  for (int b = 1; b < file_block_num; b++) {
+    if (file_block(disk_map, num, b) != file_block(disk_map, num, b - 1) + BLOCK_SIZE) {
+      runs++;
+    }
+  }
+  return runs;
+}
+
+int main() {
+  int ret;
+  int filesize = file_block_num * BLOCK_SIZE;
+  char* buf = (char*)malloc(2 * filesize);
+  generate_random_data(buf, 2 * filesize);
+
+  printf("Writing two files a block at a time in turn\n");
+
+  CHECK(create_file("mnt/a.txt"));
+  int fd_a = ret;
+  CHECK(create_file("mnt/b.txt"));
+  int fd_b = ret;
+  for (int b = 0; b < file_block_num; b++) {
+    CHECK(write_file_check(fd_a, buf + b * BLOCK_SIZE, BLOCK_SIZE, "mnt/a.txt", b * BLOCK_SIZE));
+    CHECK(write_file_check(fd_b, buf + filesize + b * BLOCK_SIZE, BLOCK_SIZE, "mnt/b.txt",
+                           b * BLOCK_SIZE));
+  }
+
+  // Write back what the cache holds, so that the image can be checked
+  if (fsync(fd_a) != 0 || fsync(fd_b) != 0) {
+    perror("fsync");
+    return FAIL;
+  }
+  CHECK(close_file(fd_a));
+  CHECK(close_file(fd_b));
+
+  struct stat st_a, st_b;
+  if (stat("mnt/a.txt", &st_a) != 0 || stat("mnt/b.txt", &st_b) != 0) {
+    perror("stat");
+    return FAIL;
+  }
+
+  // Reservations only ever live in memory, so the image holds just the files' blocks, their
+  // indirect blocks and the root directory's block
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(3, 1 + 2 * (file_block_num + 1));
+    int runs_a = file_runs(disk_map, st_a.st_ino - 1);
+    int runs_b = file_runs(disk_map, st_b.st_ino - 1);
+    if (runs_a > max_runs || runs_b > max_runs) {
+      printf("The files are stored in %d and %d runs, expected at most %d\n", runs_a, runs_b,
+             max_runs);
+      UNMAP_DISK();
+      return FAIL;
+    }
+    UNMAP_DISK();
+  }
+
+  printf("Reading them back\n");
+
+  CHECK(open_file_read("mnt/a.txt"));
+  fd_a = ret;
+  CHECK(read_file_check(fd_a, buf, filesize, "mnt/a.txt", 0));
+  CHECK(close_file(fd_a));
+  CHECK(open_file_read("mnt/b.txt"));
+  fd_b = ret;
+  CHECK(read_file_check(fd_b, buf + filesize, filesize, "mnt/b.txt", 0));
+  CHECK(close_file(fd_b));
+
+  return PASS;
+}
@@ -0,0 +1,110 @@
+#define _GNU_SOURCE // For fallocate
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int file_block_num = 10;
+
+// Blocks from fresh_from on have never been allocated and still hold the zeros mkfs wrote, so
+// none of them may be in use
+static int check_fresh(void) {
+  MAP_DISK();
+  struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+  const unsigned char* d_bitmap = (const unsigned char*)disk_map + sb->d_bitmap_ptr;
+  for (size_t b = sb->fresh_from; b < sb->num_data_blocks; b++) {
+    if (d_bitmap[b / 8] & (1 << (b % 8))) {
+      printf("Block %ld is in use past the fresh mark at %ld\n", b, sb->fresh_from);
+      UNMAP_DISK();
+      return FAIL;
+    }
+  }
+  UNMAP_DISK();
+  return PASS;
+}
+
+int main() {
+  int ret;
+
+  {
+    MAP_DISK();
+    CHECK_FEATURE(WFS_FEATURE_BLOCK_SIZE);
+    if (((struct wfs_sb*)disk_map)->fresh_from != 0) {
+      printf("A new image has blocks that are not fresh\n");
+      UNMAP_DISK();
+      return FAIL;
+    }
+    UNMAP_DISK();
+  }
+
+  int filesize = file_block_num * BLOCK_SIZE;
+  char* buf = (char*)malloc(filesize);
+  generate_random_data(buf, filesize);
+  char* zeros = (char*)calloc(1, 2 * filesize);
+
+  printf("Writing and removing a file of %d blocks\n", file_block_num);
+
+  CHECK(create_file("mnt/old.txt"));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, filesize, "mnt/old.txt", 0));
+  CHECK(close_file(fd));
+  CHECK(check_fresh());
+  CHECK(remove_file("mnt/old.txt"));
+
+  printf("Reusing its blocks\n");
+
+  // Blocks that held the old file's data are zeroed before they are given out again, however
+  // the new file comes by them
+  CHECK(create_file("mnt/new.txt"));
+  fd = ret;
+  zeros[5 * BLOCK_SIZE + 7] = buf[0];
+  CHECK(write_file_check(fd, buf, 1, "mnt/new.txt", 5 * BLOCK_SIZE + 7));
+  if (fallocate(fd, 0, 0, filesize) != 0) {
+    perror("fallocate");
+    return FAIL;
+  }
+  if (ftruncate(fd, 2 * filesize) != 0) {
+    perror("ftruncate");
+    return FAIL;
+  }
+  CHECK(close_file(fd));
+
+  CHECK(open_file_read("mnt/new.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, zeros, 2 * filesize, "mnt/new.txt", 0));
+  CHECK(close_file(fd));
+  CHECK(check_fresh());
+
+  // The root directory's block, the new file's allocated blocks and its indirect block
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(2, 1 + file_block_num + 1);
+    UNMAP_DISK();
+  }
+
+  printf("Writing a few bytes into fresh blocks\n");
+
+  CHECK(create_file("mnt/fresh.txt"));
+  fd = ret;
+  memset(zeros, 0, 2 * filesize);
+  memcpy(zeros + 3, buf, 10);
+  CHECK(write_file_check(fd, buf, 10, "mnt/fresh.txt", 3));
+  CHECK(close_file(fd));
+
+  CHECK(open_file_read("mnt/fresh.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, zeros, 13, "mnt/fresh.txt", 0));
+  CHECK(close_file(fd));
+  CHECK(check_fresh());
+
+  CHECK(remove_file("mnt/new.txt"));
+  CHECK(remove_file("mnt/fresh.txt"));
+  CHECK(check_fresh());
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "common/test.h"
+
+const int writer_num = 4;
+const int reader_num = 4;
+const int file_block_num = 20;
+const int chunk_block_num = 4;
+const int shared_block_num = 40;
+const int read_rounds = 20;
+
+// The root, the shared file and one file per writer; the root's block, and each file's blocks
+// and indirect block
+const int expected_inode_count = 2 + writer_num;
+const int expected_data_block_count =
+    1 + (shared_block_num + 1) + writer_num * (file_block_num + 1);
+
+static char* shared_buf;
+static char* writer_bufs;
+
+// Creates a file of its own and writes it a few blocks at a time, then reads it back
+static int writer(int i) {
+  int ret;
+  char path[32];
+  int filesize = file_block_num * BLOCK_SIZE;
+  char* buf = writer_bufs + i * filesize;
+  sprintf(path, "mnt/file%d", i);
+  CHECK(create_file(path));
+  int fd = ret;
+  for (int off = 0; off < filesize; off += chunk_block_num * BLOCK_SIZE) {
+    CHECK(write_file_check(fd, buf + off, chunk_block_num * BLOCK_SIZE, path, off));
+  }
+  CHECK(close_file(fd));
+  CHECK(open_file_read(path));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, filesize, path, 0));
+  CHECK(close_file(fd));
+  return PASS;
+}
+
+// Reads the shared file over and over, alongside the other readers and the writers
+static int reader(void) {
+  int ret;
+  for (int round = 0; round < read_rounds; round++) {
+    CHECK(open_file_read("mnt/shared.txt"));
+    int fd = ret;
+    CHECK(read_file_check(fd, shared_buf, shared_block_num * BLOCK_SIZE, "mnt/shared.txt", 0));
+    CHECK(close_file(fd));
+    struct stat st;
+    if (stat("mnt", &st) != 0 || stat("mnt/shared.txt", &st) != 0 ||
+        st.st_size != shared_block_num * BLOCK_SIZE) {
+      printf("stat failed while reading\n");
+      return FAIL;
+    }
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  shared_buf = (char*)malloc(shared_block_num * BLOCK_SIZE);
+  writer_bufs = (char*)malloc(writer_num * file_block_num * BLOCK_SIZE);
+  generate_random_data(shared_buf, shared_block_num * BLOCK_SIZE);
+  generate_random_data(writer_bufs, writer_num * file_block_num * BLOCK_SIZE);
+
+  CHECK(create_file("mnt/shared.txt"));
+  int fd = ret;
+  CHECK(write_file_check(fd, shared_buf, shared_block_num * BLOCK_SIZE, "mnt/shared.txt", 0));
+  CHECK(close_file(fd));
+
+  printf("Running %d writers and %d readers at once\n", writer_num, reader_num);
+
+  // wfs is mounted without -s, so the requests of the processes are served in parallel
+  for (int i = 0; i < writer_num + reader_num; i++) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+      return FAIL;
+    }
+    if (pid == 0) {
+      exit((i < writer_num ? writer(i) : reader()) == PASS ? 0 : 1);
+    }
+  }
+  int failed = 0;
+  int status;
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed++;
+    }
+  }
+  if (failed) {
+    printf("%d of the processes failed\n", failed);
+    return FAIL;
+  }
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, expected_data_block_count);
+    UNMAP_DISK();
+  }
+
+  printf("Reading back and removing everything\n");
+
+  char path[32];
+  for (int i = 0; i < writer_num; i++) {
+    sprintf(path, "mnt/file%d", i);
+    CHECK(open_file_read(path));
+    fd = ret;
+    CHECK(read_file_check(fd, writer_bufs + i * file_block_num * BLOCK_SIZE,
+                          file_block_num * BLOCK_SIZE, path, 0));
+    CHECK(close_file(fd));
+    CHECK(remove_file(path));
+  }
+  CHECK(remove_file("mnt/shared.txt"));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
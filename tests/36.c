@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/statvfs.h>
+#include "common/test.h"
+
+const int proc_num = 8;
+const int file_num = 10; // For each process
+const int file_block_num = 2;
+
+// The root, the directory and the files; the root's block, the directory's blocks of dentries and
+// the files' blocks
+const int expected_inode_count = 2 + proc_num * file_num;
+const int expected_data_block_count = 1 + (proc_num * file_num * sizeof(struct wfs_dentry) + BLOCK_SIZE - 1) / BLOCK_SIZE +
+                                      proc_num * file_num * file_block_num;
+
+static char* bufs;
+
+static char* file_buf(int p, int f) {
+  return bufs + (p * file_num + f) * file_block_num * BLOCK_SIZE;
+}
+
+// Creates and writes this process's files in the shared directory, alongside the others
+static int create_files(int p) {
+  int ret;
+  char path[32];
+  for (int f = 0; f < file_num; f++) {
+    sprintf(path, "mnt/dir/p%d_f%d", p, f);
+    CHECK(create_file(path));
+    int fd = ret;
+    CHECK(write_file_check(fd, file_buf(p, f), file_block_num * BLOCK_SIZE, path, 0));
+    CHECK(close_file(fd));
+  }
+  return PASS;
+}
+
+static int remove_files(int p) {
+  int ret;
+  char path[32];
+  for (int f = 0; f < file_num; f++) {
+    sprintf(path, "mnt/dir/p%d_f%d", p, f);
+    CHECK(remove_file(path));
+  }
+  return PASS;
+}
+
+// Runs fn in proc_num processes at once
+static int run_all(int (*fn)(int)) {
+  for (int p = 0; p < proc_num; p++) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("fork");
+      return FAIL;
+    }
+    if (pid == 0) {
+      exit(fn(p) == PASS ? 0 : 1);
+    }
+  }
+  int failed = 0;
+  int status;
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed++;
+    }
+  }
+  if (failed) {
+    printf("%d of the processes failed\n", failed);
+    return FAIL;
+  }
+  return PASS;
+}
+
+// The free counts statfs reports are kept with atomics and must still match the bitmaps
+static int check_statfs(void) {
+  struct statvfs stv;
+  if (statvfs("mnt", &stv) != 0) {
+    perror("statvfs");
+    return FAIL;
+  }
+  MAP_DISK();
+  struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+  size_t free_inodes = sb->num_inodes - inode_count(disk_map);
+  size_t free_blocks = sb->num_data_blocks - data_block_count(disk_map);
+  UNMAP_DISK();
+  if (stv.f_ffree != free_inodes || stv.f_bfree != free_blocks) {
+    printf("statvfs reports %ld free inodes and %ld free blocks, the bitmaps %ld and %ld\n",
+           stv.f_ffree, stv.f_bfree, free_inodes, free_blocks);
+    return FAIL;
+  }
+  return PASS;
+}
+
+int main() {
+  int ret;
+  bufs = (char*)malloc(proc_num * file_num * file_block_num * BLOCK_SIZE);
+  generate_random_data(bufs, proc_num * file_num * file_block_num * BLOCK_SIZE);
+
+  printf("Creating %d files from each of %d processes at once\n", file_num, proc_num);
+
+  CHECK(create_dir("mnt/dir"));
+  CHECK(run_all(create_files));
+
+  // No inode or block went to two files, and none was lost
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(expected_inode_count, expected_data_block_count);
+    UNMAP_DISK();
+  }
+  CHECK(check_statfs());
+
+  char path[32];
+  for (int p = 0; p < proc_num; p++) {
+    for (int f = 0; f < file_num; f++) {
+      sprintf(path, "mnt/dir/p%d_f%d", p, f);
+      CHECK(open_file_read(path));
+      int fd = ret;
+      CHECK(read_file_check(fd, file_buf(p, f), file_block_num * BLOCK_SIZE, path, 0));
+      CHECK(close_file(fd));
+    }
+  }
+
+  printf("Removing them from every process at once\n");
+
+  CHECK(run_all(remove_files));
+  CHECK(remove_dir("mnt/dir"));
+  CHECK(check_statfs());
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+const int file_block_num = 40;
+const int hole_block_num = 10;
+const int tail_size = 100;
+
+// Where logical block b of the file with inode number num lies on the image, for blocks reached
+// through the direct pointers and the single indirect block
+static off_t file_block(char* disk_map, int num, int b) {
+  struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+  struct wfs_inode* inode = (struct wfs_inode*)(disk_map + sb->i_blocks_ptr + num * BLOCK_SIZE);
+  if (b < D_BLOCK) {
+    return inode->blocks[b];
+  }
+  if (inode->blocks[IND_BLOCK] == 0) {
+    return 0;
+  }
+  return ((off_t*)(disk_map + inode->blocks[IND_BLOCK]))[b - D_BLOCK];
+}
+
+// Reads size bytes from offset in one read and checks that exactly expected_size of them come
+// back, matching expected_content
+static int read_check(int fd, const char* expected_content, size_t size, size_t expected_size,
+                      off_t offset) {
+  char* buffer = (char*)malloc(size);
+  ssize_t bytesRead = pread(fd, buffer, size, offset);
+  if (bytesRead != expected_size) {
+    printf("Read %ld bytes at offset %ld, expected %ld\n", bytesRead, offset, expected_size);
+    free(buffer);
+    return FAIL;
+  }
+  if (memcmp(buffer, expected_content + offset, expected_size) != 0) {
+    printf("Read at offset %ld of %ld bytes does not match\n", offset, size);
+    free(buffer);
+    return FAIL;
+  }
+  free(buffer);
+  return PASS;
+}
+
+int main() {
+  int ret;
+  int filesize = file_block_num * BLOCK_SIZE;
+  int full_size = (file_block_num + hole_block_num) * BLOCK_SIZE + tail_size;
+  char* buf = (char*)malloc(2 * filesize);
+  generate_random_data(buf, 2 * filesize);
+
+  // What file a holds once written: its blocks, a hole and a short tail
+  char* expected = (char*)calloc(1, full_size);
+  memcpy(expected, buf, filesize);
+  memcpy(expected + full_size - tail_size, buf + filesize, tail_size);
+
+  printf("Writing two files a block at a time in turn, then a tail past a hole\n");
+
+  CHECK(create_file("mnt/a.txt"));
+  int fd_a = ret;
+  CHECK(create_file("mnt/b.txt"));
+  int fd_b = ret;
+  for (int b = 0; b < file_block_num; b++) {
+    CHECK(write_file_check(fd_a, buf + b * BLOCK_SIZE, BLOCK_SIZE, "mnt/a.txt", b * BLOCK_SIZE));
+    CHECK(write_file_check(fd_b, buf + filesize + b * BLOCK_SIZE, BLOCK_SIZE, "mnt/b.txt",
+                           b * BLOCK_SIZE));
+  }
+  CHECK(write_file_check(fd_a, buf + filesize, tail_size, "mnt/a.txt", full_size - tail_size));
+  CHECK(close_file(fd_a));
+  CHECK(close_file(fd_b));
+
+  // The root's block, then each file's data blocks and indirect block
+  struct stat st;
+  if (stat("mnt/a.txt", &st) != 0) {
+    perror("stat");
+    return FAIL;
+  }
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(3, 1 + (file_block_num + 2) + (file_block_num + 1));
+
+    // Reads are answered with one buffer per run of contiguous blocks, so the reads below must
+    // cross from one run to the next
+    int runs = 1;
+    for (int b = 1; b < file_block_num; b++) {
+      if (file_block(disk_map, st.st_ino - 1, b) !=
+          file_block(disk_map, st.st_ino - 1, b - 1) + BLOCK_SIZE) {
+        runs++;
+      }
+    }
+    if (runs < 2) {
+      printf("mnt/a.txt is stored in one run\n");
+      UNMAP_DISK();
+      return FAIL;
+    }
+    UNMAP_DISK();
+  }
+
+  printf("Reading it back whole, at odd offsets, across the hole and past the end\n");
+
+  CHECK(open_file_read("mnt/a.txt"));
+  fd_a = ret;
+  CHECK(read_check(fd_a, expected, full_size, full_size, 0));
+
+  off_t offsets[] = {7, BLOCK_SIZE - 1, 8 * BLOCK_SIZE - 3, 13 * BLOCK_SIZE + 5,
+                     23 * BLOCK_SIZE + 257};
+  for (int i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+    CHECK(read_check(fd_a, expected, 9 * BLOCK_SIZE + 11, 9 * BLOCK_SIZE + 11, offsets[i]));
+  }
+
+  // The hole reads as zeros, alone and from the last data blocks before it to the tail after it
+  CHECK(read_check(fd_a, expected, hole_block_num * BLOCK_SIZE, hole_block_num * BLOCK_SIZE,
+                   file_block_num * BLOCK_SIZE));
+  CHECK(read_check(fd_a, expected, (hole_block_num + 2) * BLOCK_SIZE + tail_size,
+                   (hole_block_num + 2) * BLOCK_SIZE + tail_size, (file_block_num - 2) * BLOCK_SIZE));
+
+  // A read past the end comes back short, and one at the end empty
+  CHECK(read_check(fd_a, expected, 4 * BLOCK_SIZE, tail_size + 1, full_size - tail_size - 1));
+  CHECK(read_check(fd_a, expected, BLOCK_SIZE, 0, full_size));
+  CHECK(close_file(fd_a));
+
+  CHECK(open_file_read("mnt/b.txt"));
+  fd_b = ret;
+  CHECK(read_check(fd_b, buf + filesize, filesize, filesize, 0));
+  CHECK(close_file(fd_b));
+
+  CHECK(remove_file("mnt/a.txt"));
+  CHECK(remove_file("mnt/b.txt"));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
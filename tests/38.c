@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(off_t))
+
+// Larger than a single FUSE write request, so the kernel sends it in several, and reaching past the
+// single indirect block
+const int file_block_num = 280;
+const int short_by = 50;
+const int gap_block_num = 10;
+const int gap_extra = 33;
+const int tail_size = 200;
+
+int main() {
+  int ret;
+  int filesize = file_block_num * BLOCK_SIZE - short_by;
+  int tail_off = (file_block_num + gap_block_num) * BLOCK_SIZE + gap_extra;
+  int full_size = tail_off + tail_size;
+  char* buf = (char*)malloc(full_size);
+  generate_random_data(buf, full_size);
+
+  // The double indirect block and the indirect blocks under it come on top of the data blocks, the
+  // single indirect block and the root's block
+  int dind_start = D_BLOCK + PTRS_PER_BLOCK;
+  int expected_block_count =
+      1 + file_block_num + 1 + 1 + (file_block_num - dind_start + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+
+  printf("Writing %d bytes in one write\n", filesize);
+
+  CHECK(create_file("mnt/big.txt"));
+  int fd = ret;
+  CHECK(write_file_check(fd, buf, filesize, "mnt/big.txt", 0));
+  CHECK(close_file(fd));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(2, expected_block_count);
+    UNMAP_DISK();
+  }
+
+  CHECK(open_file_read("mnt/big.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, filesize, "mnt/big.txt", 0));
+  CHECK(close_file(fd));
+
+  printf("Overwriting blocks in part\n");
+
+  // Starts and ends partway through a block, so the blocks at either end keep the rest of what
+  // they held
+  int over_off = 3 * BLOCK_SIZE + 100;
+  int over_size = 5 * BLOCK_SIZE + 17;
+  generate_random_data(buf + over_off, over_size);
+  CHECK(open_file_write("mnt/big.txt"));
+  fd = ret;
+  CHECK(write_file_check(fd, buf + over_off, over_size, "mnt/big.txt", over_off));
+  CHECK(close_file(fd));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(2, expected_block_count);
+    UNMAP_DISK();
+  }
+
+  printf("Writing past the end\n");
+
+  // Everything between the old end and the new write reads as zeros: the rest of the last block,
+  // which was never written, and the blocks skipped over, which are left as a hole
+  memset(buf + filesize, 0, tail_off - filesize);
+  CHECK(open_file_write("mnt/big.txt"));
+  fd = ret;
+  CHECK(write_file_check(fd, buf + tail_off, tail_size, "mnt/big.txt", tail_off));
+  CHECK(close_file(fd));
+
+  struct stat st;
+  if (stat("mnt/big.txt", &st) != 0 || st.st_size != full_size) {
+    printf("mnt/big.txt: expected size %d\n", full_size);
+    return FAIL;
+  }
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(2, expected_block_count + 1);
+    UNMAP_DISK();
+  }
+
+  CHECK(open_file_read("mnt/big.txt"));
+  fd = ret;
+  CHECK(read_file_check(fd, buf, full_size, "mnt/big.txt", 0));
+  CHECK(close_file(fd));
+
+  CHECK(remove_file("mnt/big.txt"));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
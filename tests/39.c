@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "common/test.h"
+
+// Mounted with a cache of 8 blocks, far fewer than the files hold, so that blocks are evicted and
+// read back in again between one round and the next
+const int file_num = 4;
+const int file_block_num = 20;
+const int round_num = 4;
+
+// The root's block, then each file's data blocks and indirect block
+const int expected_data_block_count = 1 + file_num * (file_block_num + 1);
+
+// Writes the cache back and waits for the disk, so that the image can be checked
+static int sync_path(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fsync(fd) != 0) {
+    perror("fsync");
+    return FAIL;
+  }
+  close(fd);
+  return PASS;
+}
+
+int main() {
+  int ret;
+  int filesize = file_block_num * BLOCK_SIZE;
+  char* bufs = (char*)malloc(file_num * filesize);
+  generate_random_data(bufs, file_num * filesize);
+
+  printf("Writing %d files of %d blocks through a cache of 8 blocks\n", file_num, file_block_num);
+
+  char path[32];
+  for (int f = 0; f < file_num; f++) {
+    sprintf(path, "mnt/file%d", f);
+    CHECK(create_file(path));
+    int fd = ret;
+    CHECK(write_file_check(fd, bufs + f * filesize, filesize, path, 0));
+    CHECK(close_file(fd));
+  }
+
+  for (int r = 0; r < round_num; r++) {
+    printf("Round %d: overwriting part of each file and reading them all back\n", r);
+
+    // Each overwrite starts and ends partway through a block, somewhere else each time, so that
+    // the blocks at either end must be read in before being written
+    for (int f = 0; f < file_num; f++) {
+      int offset = ((r * 7 + f * 3) % (file_block_num - 4)) * BLOCK_SIZE + 37 * (r + 1);
+      int size = 3 * BLOCK_SIZE + 11 * (f + 1);
+      char* content = bufs + f * filesize + offset;
+      generate_random_data(content, size);
+      sprintf(path, "mnt/file%d", f);
+      CHECK(open_file_write(path));
+      int fd = ret;
+      CHECK(write_file_check(fd, content, size, path, offset));
+      CHECK(close_file(fd));
+    }
+
+    for (int f = 0; f < file_num; f++) {
+      sprintf(path, "mnt/file%d", f);
+      CHECK(open_file_read(path));
+      int fd = ret;
+      CHECK(read_file_check(fd, bufs + f * filesize, filesize, path, 0));
+      CHECK(close_file(fd));
+    }
+  }
+
+  CHECK(sync_path("mnt/file0"));
+
+  {
+    MAP_DISK();
+    CHECK_INODE_AND_BLOCK_COUNT(1 + file_num, expected_data_block_count);
+
+    // What was written back must be what the files hold
+    struct wfs_sb* sb = (struct wfs_sb*)disk_map;
+    for (int f = 0; f < file_num; f++) {
+      struct stat st;
+      sprintf(path, "mnt/file%d", f);
+      if (stat(path, &st) != 0) {
+        perror("stat");
+        UNMAP_DISK();
+        return FAIL;
+      }
+      struct wfs_inode* inode =
+          (struct wfs_inode*)(disk_map + sb->i_blocks_ptr + (st.st_ino - 1) * BLOCK_SIZE);
+      off_t* ind = (off_t*)(disk_map + inode->blocks[IND_BLOCK]);
+      for (int b = 0; b < file_block_num; b++) {
+        off_t block = b < D_BLOCK ? inode->blocks[b] : ind[b - D_BLOCK];
+        if (memcmp(disk_map + block, bufs + f * filesize + b * BLOCK_SIZE, BLOCK_SIZE) != 0) {
+          printf("Block %d of %s on the image does not match\n", b, path);
+          UNMAP_DISK();
+          return FAIL;
+        }
+      }
+    }
+    UNMAP_DISK();
+  }
+
+  printf("Removing them\n");
+
+  for (int f = 0; f < file_num; f++) {
+    sprintf(path, "mnt/file%d", f);
+    CHECK(remove_file(path));
+  }
+  CHECK(sync_path("mnt"));
+
+  MAP_DISK();
+  CHECK_INODE_AND_BLOCK_COUNT(1, 1);
+  UNMAP_DISK();
+
+  return PASS;
+}
@@ -47,8 +47,43 @@ struct wfs_sb {
   off_t d_bitmap_ptr;
   off_t i_blocks_ptr;
   off_t d_blocks_ptr;
+
+  /* Extended superblock, on images made with any optional mkfs flag */
+  size_t magic;
+  size_t features;
+  size_t block_size;
+  size_t inode_size;
+
+  size_t num_groups;
+  size_t inodes_per_group;
+  size_t blocks_per_group;
+  off_t gd_ptr;
+
+  size_t free_inodes;
+  size_t free_blocks;
+  size_t fresh_from;
 };
 
+// Group descriptor, with mkfs -G: where one allocation group's regions start
+struct wfs_group_desc {
+  off_t i_bitmap_ptr;
+  off_t d_bitmap_ptr;
+  off_t i_blocks_ptr;
+  off_t d_blocks_ptr;
+  size_t free_inodes;
+  size_t free_blocks;
+  size_t fresh_from;
+};
+
+#define WFS_MAGIC (0x5746535355504552UL)
+
+#define WFS_FEATURE_DIR_INDEX (1UL << 0)   /* mkfs -H */
+#define WFS_FEATURE_EXTENTS (1UL << 1)     /* mkfs -E */
+#define WFS_FEATURE_BLOCK_SIZE (1UL << 2)  /* mkfs -B */
+#define WFS_FEATURE_INLINE_DATA (1UL << 3) /* mkfs -D */
+#define WFS_FEATURE_INODE_SIZE (1UL << 4)  /* mkfs -I */
+#define WFS_FEATURE_GROUPS (1UL << 5)      /* mkfs -G */
+
 // Inode
 struct wfs_inode {
   int num;     /* Inode number */
@@ -75,6 +110,7 @@ extern const char* new_disk_path;
 
 char* map_disk();
 char* unmap_disk(char* disk_map);
+size_t bitmap_count(const char* start, size_t size);
 size_t inode_count(char* disk_map);
 size_t data_block_count(char* disk_map);
 int open_file_read(const char* path);
@@ -124,6 +160,14 @@ int expected_datablock_num(int file_block_num, int cur_file_num);
     return FAIL;                                                   \
   }
 
+#define CHECK_FEATURE(feature)                                       \
+  if (((struct wfs_sb*)disk_map)->magic != WFS_MAGIC ||              \
+      !(((struct wfs_sb*)disk_map)->features & (feature))) {         \
+    printf("Image was not made with " #feature "\n");                \
+    UNMAP_DISK();                                                    \
+    return FAIL;                                                     \
+  }
+
 #define CHECK_MAPPED(cond) \
   ret = cond;              \
   if (ret == FAIL) {       \